@@ -0,0 +1,238 @@
+#ifdef WIN_COMPILE
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <limits.h>
+#include "exprmatrix.h"
+
+// Writes the rows of an R matrix, converted to T, in row-major order.
+template <class T>
+static bool write_rows(FILE * f, const double * x, int nrow, int ncol)
+{
+	if(ncol == 0) return true;
+	const int block = 256;
+	vector<T> buf((size_t)block * ncol);
+	for(int first=0; first<nrow; first+=block){
+		const int len = min(block, nrow - first);
+		for(int j=0; j<ncol; j++){
+			const double * col = x + (size_t)j*nrow + first;
+			for(int r=0; r<len; r++) buf[(size_t)r*ncol + j] = (T)col[r];
+		}
+		if(fwrite(&buf[0], sizeof(T), (size_t)len*ncol, f) != (size_t)len*ncol)
+			return false;
+	}
+	return true;
+}
+
+/* Writes an expression matrix to FILENAME in the layout described in exprmatrix.h.
+ * TYPE is "double" (float64) or "float" (float32). Row names of X are used as the gene
+ * name index.
+ */
+SEXP writeExprMatrix(SEXP X, SEXP FILENAME, SEXP TYPE)
+{
+	if(!Rf_isReal(X))
+		X = Rf_coerceVector(X, REALSXP);
+	PROTECT(X);
+
+	const uint64_t nrow = Rf_nrows(X), ncol = Rf_ncols(X);
+	const uint32_t version = NPM_MATRIX_VERSION;
+	const uint32_t dtype = strcmp(CHAR(STRING_ELT(TYPE, 0)), "float") ? NPM_MATRIX_FLOAT64 : NPM_MATRIX_FLOAT32;
+
+	SEXP DIMNAMES = Rf_getAttrib(X, R_DimNamesSymbol);
+	SEXP ROWNAMES = Rf_isNull(DIMNAMES) ? R_NilValue : VECTOR_ELT(DIMNAMES, 0);
+
+	uint64_t offset = NPM_MATRIX_HEADER;
+	for(uint64_t i=0; i<nrow; i++)
+		offset += (Rf_isNull(ROWNAMES) ? 0 : strlen(Rf_translateCharUTF8(STRING_ELT(ROWNAMES, i)))) + 1;
+	offset = (offset + 63) & ~(uint64_t)63;
+
+	FILE * f = fopen(R_ExpandFileName(CHAR(STRING_ELT(FILENAME, 0))), "wb");
+	if(f == NULL)
+		Rf_error("Cannot open %s for writing.", CHAR(STRING_ELT(FILENAME, 0)));
+
+	bool ok = fwrite(NPM_MATRIX_MAGIC, 1, 8, f) == 8;
+	ok = ok && fwrite(&version, sizeof(version), 1, f) == 1;
+	ok = ok && fwrite(&dtype, sizeof(dtype), 1, f) == 1;
+	ok = ok && fwrite(&nrow, sizeof(nrow), 1, f) == 1;
+	ok = ok && fwrite(&ncol, sizeof(ncol), 1, f) == 1;
+	ok = ok && fwrite(&offset, sizeof(offset), 1, f) == 1;
+
+	uint64_t pos = NPM_MATRIX_HEADER;
+	for(uint64_t i=0; i<nrow && ok; i++){
+		const char * name = Rf_isNull(ROWNAMES) ? "" : Rf_translateCharUTF8(STRING_ELT(ROWNAMES, i));
+		ok = fwrite(name, 1, strlen(name) + 1, f) == strlen(name) + 1;
+		pos += strlen(name) + 1;
+	}
+	for(; pos<offset && ok; pos++)
+		ok = fputc(0, f) != EOF;
+
+	if(ok)
+		ok = dtype == NPM_MATRIX_FLOAT64 ? write_rows<double>(f, REAL(X), nrow, ncol)
+				: write_rows<float>(f, REAL(X), nrow, ncol);
+	if(fclose(f) != 0) ok = false;
+
+	if(!ok)
+		Rf_error("Error writing %s.", CHAR(STRING_ELT(FILENAME, 0)));
+
+	UNPROTECT(1);
+	return(R_NilValue);
+}
+
+static void npm_matrix_unmap(npm_matrix * m)
+{
+	if(m->base != NULL){
+#ifdef WIN_COMPILE
+		UnmapViewOfFile(m->base);
+#else
+		munmap(m->base, m->size);
+#endif
+	}
+	free(m);
+}
+
+static void npm_matrix_finalizer(SEXP PTR)
+{
+	npm_matrix * m = (npm_matrix *)R_ExternalPtrAddr(PTR);
+	if(m == NULL) return;
+	npm_matrix_unmap(m);
+	R_ClearExternalPtr(PTR);
+}
+
+npm_matrix * npm_matrix_get(SEXP X)
+{
+	if(TYPEOF(X) != EXTPTRSXP || R_ExternalPtrTag(X) != Rf_install("NPMMatrix"))
+		return NULL;
+	npm_matrix * m = (npm_matrix *)R_ExternalPtrAddr(X);
+	if(m == NULL)
+		Rf_error("The expression matrix is no longer mapped. Map the file again with mapExpressionMatrix.");
+	return m;
+}
+
+// Maps a file read-only. Returns NULL on failure.
+static void * map_file(const char * filename, size_t * size)
+{
+#ifdef WIN_COMPILE
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE) return NULL;
+	LARGE_INTEGER len;
+	if(!GetFileSizeEx(file, &len) || len.QuadPart == 0){ CloseHandle(file); return NULL; }
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if(mapping == NULL) return NULL;
+	void * base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping); // the view keeps the mapping alive
+	*size = (size_t)len.QuadPart;
+	return base;
+#else
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0) return NULL;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0){ close(fd); return NULL; }
+	void * base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); // the mapping stays valid
+	if(base == MAP_FAILED) return NULL;
+	*size = st.st_size;
+	return base;
+#endif
+}
+
+/* Maps an expression matrix file. Returns a list of the external pointer to the mapping,
+ * the dimensions, the gene names and the value type.
+ */
+SEXP mapExprMatrix(SEXP FILENAME)
+{
+	const char * filename = R_ExpandFileName(CHAR(STRING_ELT(FILENAME, 0)));
+	npm_matrix * m = (npm_matrix *)calloc(1, sizeof(npm_matrix));
+	if(m == NULL)
+		Rf_error("Cannot allocate memory.");
+
+	m->base = map_file(filename, &m->size);
+	if(m->base == NULL){
+		free(m);
+		Rf_error("Cannot map %s.", filename);
+	}
+
+	const char * base = (const char *)m->base;
+	uint32_t version, dtype;
+	uint64_t nrow, ncol, offset;
+	if(m->size < NPM_MATRIX_HEADER || memcmp(base, NPM_MATRIX_MAGIC, 8) != 0){
+		npm_matrix_unmap(m);
+		Rf_error("%s is not an expression matrix file.", filename);
+	}
+	memcpy(&version, base + 8, 4);
+	memcpy(&dtype, base + 12, 4);
+	memcpy(&nrow, base + 16, 8);
+	memcpy(&ncol, base + 24, 8);
+	memcpy(&offset, base + 32, 8);
+
+	const uint32_t swapped = (version >> 24) | ((version >> 8) & 0xFF00) | ((version << 8) & 0xFF0000) | (version << 24);
+	if(version != NPM_MATRIX_VERSION && swapped == NPM_MATRIX_VERSION){
+		npm_matrix_unmap(m);
+		Rf_error("%s was written on a machine of a different byte order. Write it again on this machine.", filename);
+	}
+
+	const size_t elsize = dtype == NPM_MATRIX_FLOAT64 ? sizeof(double) : sizeof(float);
+	if(version != NPM_MATRIX_VERSION || (dtype != NPM_MATRIX_FLOAT64 && dtype != NPM_MATRIX_FLOAT32)
+			|| nrow > INT_MAX || ncol > INT_MAX || offset < NPM_MATRIX_HEADER || offset % 64 != 0
+			|| offset > m->size || (m->size - offset) / elsize / (ncol ? ncol : 1) < nrow){
+		npm_matrix_unmap(m);
+		Rf_error("%s is corrupted or has an unsupported format.", filename);
+	}
+	m->nrow = nrow; m->ncol = ncol; m->dtype = dtype;
+	m->data = base + offset;
+
+	SEXP PTR, DIM, ROWNAMES, OUT, NAMES;
+	PROTECT( PTR = R_MakeExternalPtr(m, Rf_install("NPMMatrix"), R_NilValue) );
+	R_RegisterCFinalizerEx(PTR, npm_matrix_finalizer, TRUE);
+
+	// Gene name index.
+	PROTECT( ROWNAMES = NEW_STRING(m->nrow) );
+	const char * name = base + NPM_MATRIX_HEADER;
+	for(int i=0; i<m->nrow; i++){
+		const char * end = (const char *)memchr(name, 0, base + offset - name);
+		if(end == NULL)
+			Rf_error("%s has a corrupted gene name index.", filename);
+		SET_STRING_ELT(ROWNAMES, i, Rf_mkCharCE(name, CE_UTF8));
+		name = end + 1;
+	}
+
+	PROTECT( DIM = NEW_INTEGER(2) );
+	INTEGER(DIM)[0] = m->nrow;
+	INTEGER(DIM)[1] = m->ncol;
+
+	PROTECT( OUT = NEW_LIST(4) );
+	PROTECT( NAMES = NEW_STRING(4) );
+	SET_VECTOR_ELT(OUT, 0, PTR);	SET_STRING_ELT(NAMES, 0, Rf_mkChar("ptr"));
+	SET_VECTOR_ELT(OUT, 1, DIM);	SET_STRING_ELT(NAMES, 1, Rf_mkChar("dim"));
+	SET_VECTOR_ELT(OUT, 2, ROWNAMES);	SET_STRING_ELT(NAMES, 2, Rf_mkChar("rownames"));
+	SET_VECTOR_ELT(OUT, 3, Rf_mkString(dtype == NPM_MATRIX_FLOAT64 ? "double" : "float"));
+	SET_STRING_ELT(NAMES, 3, Rf_mkChar("type"));
+
+	Rf_setAttrib(OUT, R_NamesSymbol, NAMES);
+	UNPROTECT(5);
+	return(OUT);
+}
+
+// Reads a mapped expression matrix into an R matrix (without row names).
+SEXP readExprMatrix(SEXP PTR)
+{
+	const npm_matrix * m = npm_matrix_get(PTR);
+	if(m == NULL)
+		Rf_error("Not a mapped expression matrix.");
+
+	SEXP X;
+	PROTECT( X = Rf_allocMatrix(REALSXP, m->nrow, m->ncol) );
+	vector<double> buf(max(m->ncol, 1));
+	double * x = REAL(X);
+	for(int i=0; i<m->nrow; i++){
+		const double * row = npm_matrix_row(m, i, &buf[0]);
+		for(int j=0; j<m->ncol; j++) x[i + (size_t)j*m->nrow] = row[j];
+	}
+	UNPROTECT(1);
+	return(X);
+}
@@ -0,0 +1,54 @@
+#ifndef __exprmatrix__h_
+#define __exprmatrix__h_
+
+#include <stdint.h>
+#include "init.h"
+
+/* On-disk expression matrix.
+ *
+ * A binary file, in the byte order of the machine that wrote it, with genes as rows and
+ * samples as columns:
+ *
+ *   offset  size   content
+ *        0     8   magic "NPMEXPR\0"
+ *        8     4   format version (uint32, currently 1)
+ *       12     4   value type (uint32): 1 = float64, 2 = float32
+ *       16     8   number of genes, nrow (uint64)
+ *       24     8   number of samples, ncol (uint64)
+ *       32     8   offset of the values (uint64, a multiple of 64)
+ *       40         gene name index: nrow NUL-terminated UTF-8 names, in row order,
+ *                  zero-padded up to the offset of the values
+ *   offset         nrow x ncol values, row-major (each gene's row is contiguous)
+ *
+ * Files are memory-mapped read-only, so only the pages of the rows actually used are
+ * ever read from disk. Values are mapped as they are, so files are not portable across byte
+ * orders: the format version doubles as a byte order mark, and files written on a machine
+ * of the other byte order are rejected.
+ */
+#define NPM_MATRIX_MAGIC "NPMEXPR"
+#define NPM_MATRIX_VERSION 1
+#define NPM_MATRIX_FLOAT64 1
+#define NPM_MATRIX_FLOAT32 2
+#define NPM_MATRIX_HEADER 40
+
+typedef struct {
+	void * base;		// mapping of the whole file
+	size_t size;
+	int nrow, ncol, dtype;
+	const char * data;	// first value
+} npm_matrix;
+
+// The mapped matrix of an external pointer created by mapExprMatrix, or NULL if X is not one.
+npm_matrix * npm_matrix_get(SEXP X);
+
+// Row `row` of a mapped matrix as doubles. Float64 rows are returned in place, float32 rows
+// are converted into buf (ncol values).
+static inline const double * npm_matrix_row(const npm_matrix * m, int row, double * buf){
+	if(m->dtype == NPM_MATRIX_FLOAT64)
+		return (const double *)(m->data + (size_t)row * m->ncol * sizeof(double));
+	const float * x = (const float *)(m->data + (size_t)row * m->ncol * sizeof(float));
+	for(int j=0; j<m->ncol; j++) buf[j] = x[j];
+	return buf;
+}
+
+#endif
@@ -1,4 +1,6 @@
 #include "hme3m.h"
+#include "parallel.h"
+#include <string.h>
 
 void hme3m_R(double *Y,
 	double *X,
@@ -16,7 +18,8 @@ void hme3m_R(double *Y,
 	double *BETA,
 	double *PROPORTIONS,
 	double *HMEPRE,
-	double *LIKELIHOOD) 
+	double *LIKELIHOOD,
+	int *NTHREADS) 
 {
 	size_t nx = (size_t)(*NX);
 	size_t nobs = (size_t)(*NOBS);
@@ -41,7 +44,8 @@ void hme3m_R(double *Y,
 		BETA,
 		PROPORTIONS,
 		HMEPRE,
-		LIKELIHOOD);
+		LIKELIHOOD,
+		npm_threads(*NTHREADS));
 }
 
 void hme3m(double * Y,
@@ -60,22 +64,30 @@ void hme3m(double * Y,
 	double * BETA,
 	double * PROPORTIONS,
 	double * HMEPRE,
-	double * LIKELIHOOD)
+	double * LIKELIHOOD,
+	int nthreads)
 {
-	int i,j,k,iter;	
+	int i,k,iter;	
 	int CONVERGED = 0;
 	double tempval = 0.0;
 	double tempval2 = 0.0;
 
-	// temporary allocations
+	// temporary allocations, for each thread
+	if (nthreads > m) nthreads = m;
 	double * mbeta;
-	MALLOC(mbeta,sizeof(double)*nx);
+	MALLOC(mbeta,sizeof(double)*nx*nthreads);
 	
 	double * mypre; 
-	MALLOC(mypre,sizeof(double)*nobs);
+	MALLOC(mypre,sizeof(double)*nobs*nthreads);
 	
 	double * mw;
-	MALLOC(mw,sizeof(double)*nobs);
+	MALLOC(mw,sizeof(double)*nobs*nthreads);
+
+	// Above IRLS_SPARSE_NX columns, IRLS solves are matrix-free.
+	irls_sparse * xs = nx > IRLS_SPARSE_NX ? irls_sparse_alloc(X, nobs, nx) : NULL;
+	irls_workspace ** ws;
+	MALLOC(ws,sizeof(irls_workspace *)*nthreads);
+	for (k = 0;k < nthreads;k = k + 1) ws[k] = irls_workspace_alloc(nobs, nx, xs);
 	
 	iter = 0;
 	while (CONVERGED == 0) {  
@@ -99,45 +111,49 @@ void hme3m(double * Y,
 /*----------------------------------------------------
                        M-STEP
 ------------------------------------------------------*/
-		tempval2 = 0.0;
-		for (k = 0;k < m;k = k + 1) { // for each component
-			tempval = 0.0;
-			for (i = 0;i < nobs;i = i + 1) tempval = tempval + H[k*nobs + i]; 
+		// Components are independent given H, and are updated concurrently.
+		#pragma omp parallel for num_threads(nthreads) schedule(dynamic,1)
+		for (int k = 0;k < m;k = k + 1) { // for each component
+			const int t = npm_thread_num();
+			double *kbeta = mbeta + nx*t, *kypre = mypre + nobs*t, *kw = mw + nobs*t;
+			double tempval = 0.0;
+			for (int i = 0;i < nobs;i = i + 1) tempval = tempval + H[k*nobs + i]; 
 
             // Estimate new pi_k = sum(pk[k]*pmx[k]*fits[k])
 			PROPORTIONS[k] = tempval; 
-       		tempval2 = tempval2 + PROPORTIONS[k];
 			
 			// Estimate a new theta
-			for (j = 0;j < nx;j = j + 1) { // for each column
+			for (int j = 0;j < nx;j = j + 1) { // for each column
 				tempval = 0.0;
-				for (i = 0;i < nobs; i = i + 1) { // sum over the rows
+				for (int i = 0;i < nobs; i = i + 1) { // sum over the rows
 					if (X[j*nobs + i] == 1.0) tempval = tempval + H[k*nobs + i];
 				}
 				THETA[k*nx + j] = tempval / PROPORTIONS[k];
 			}       
             
 			// Estimate the probability for each path beloning to that component
-			for (i = 0;i < nobs;i = i + 1) { // for each row
+			for (int i = 0;i < nobs;i = i + 1) { // for each row
 				tempval = 1.0;
-				for (j = 0;j < nx; j = j + 1) { // multiply all thetas along a row to get the probability
+				for (int j = 0;j < nx; j = j + 1) { // multiply all thetas along a row to get the probability
 					if (X[j*nobs + i] == 1.0) tempval = tempval * THETA[k*nx + j];
 				}
 				PATHPROBS[k*nobs + i] = tempval;
 			}
 
 			// Estimate new PLR models
-			for (i = 0;i < nx;i = i + 1) mbeta[i] = 0;
-			for (i = 0;i < nobs;i = i + 1) {
-				mypre[i] = 0.5;
-				mw[i] = H[k*nobs + i];
+			for (int i = 0;i < nx;i = i + 1) kbeta[i] = 0;
+			for (int i = 0;i < nobs;i = i + 1) {
+				kypre[i] = 0.5;
+				kw[i] = H[k*nobs + i];
 			}
 			
-            irls(Y,X,nobs,nx,mw,mbeta,mypre,lambda,alpha,(int)(*PLRITER));
+            irls(Y,X,nobs,nx,kw,kbeta,kypre,lambda,alpha,(int)(*PLRITER),ws[t]);
 			
-            for (i = 0;i < nobs;i = i + 1) PLRPRE[k*nobs + i] = mypre[i];
-			for (i = 0;i < nx;i = i + 1) BETA[k*nx + i] = mbeta[i];
+            for (int i = 0;i < nobs;i = i + 1) PLRPRE[k*nobs + i] = kypre[i];
+			for (int i = 0;i < nx;i = i + 1) BETA[k*nx + i] = kbeta[i];
 		}
+		tempval2 = 0.0;
+		for (k = 0;k < m;k = k + 1) tempval2 = tempval2 + PROPORTIONS[k];
  
         // normalize 3M the new mixture proportions
         for (k = 0;k < m;k = k + 1) PROPORTIONS[k] = PROPORTIONS[k]/tempval2;
@@ -193,11 +209,129 @@ void hme3m(double * Y,
 	free(mbeta);
 	free(mypre);
 	free(mw);
+	for (k = 0;k < nthreads;k = k + 1) irls_workspace_free(ws[k]);
+	free(ws);
+	if (xs != NULL) irls_sparse_free(xs);
 
 	return;
 }
 
-void pathMix(int *X,
+// log(sum(exp(x))), without overflow.
+static double logsumexp(const double *x, int n)
+{
+  double mx = R_NegInf, s = 0.0;
+  for (int k = 0; k < n; k++) if (x[k] > mx) mx = x[k];
+  if (mx == R_NegInf) return R_NegInf;
+  for (int k = 0; k < n; k++) s += exp(x[k] - mx);
+  return mx + log(s);
+}
+
+/* Column form of a sparse binary path matrix given by rows: the (0-based) offsets COLPTR
+ * (ncol + 1) of each column in ROWIND, and the rows ROWIND of its ones, in increasing order.
+ * COLIND is 1-based.
+ */
+static void sparse_columns(const int *rowptr, const int *colind, int nrow, int ncol, int *colptr, int *rowind)
+{
+  for (int j = 0; j <= ncol; j++) colptr[j] = 0;
+  for (int p = 0; p < rowptr[nrow]; p++) colptr[colind[p]-1]++;
+  for (int j = 0; j < ncol; j++) colptr[j+1] += colptr[j];
+  // fill from the last row, so the rows of each column end up in increasing order
+  for (int i = nrow - 1; i >= 0; i--) {
+    for (int p = rowptr[i+1] - 1; p >= rowptr[i]; p--) rowind[--colptr[colind[p]-1]] = i;
+  }
+}
+
+/* EM fit of the 3M Markov mixture model on a sparse binary path matrix, given by rows (ROWPTR, 1-based COLIND)
+ * and by columns (see sparse_columns). Path probabilities are accumulated as log-probabilities
+ * over the ones only, and responsibilities are normalized with log-sum-exp, so long paths do
+ * not underflow. Each iteration takes O(nnz*m).
+ *
+ * Rows are split in nthreads blocks for the E-step and the likelihood, whose sums are reduced
+ * per block, and theta is updated concurrently for each (component, column). WORK holds
+ * m*ncol + (m+1)*nthreads doubles. Returns the number of iterations.
+ */
+static int pathmix_sparse(const int *rowptr, const int *colind, const int *colptr, const int *rowind,
+    int m, int nrow, int ncol, int maxiter, double *H, double *THETA, double *PROPORTIONS,
+    double *LIKELIHOOD, double *work, int nthreads)
+{
+  double *logtheta = work, *blocksum = work + m*ncol, *blockll = blocksum + m*nthreads;
+  double tempval2 = 0.0;
+  int iter;
+
+  for (iter = 0; ; iter++) {
+    /*-----------------------------------------
+         E Step: Compute the responsiblities
+    ------------------------------------------*/
+    for (int j = 0; j < m*ncol; j++) logtheta[j] = log(THETA[j]);
+    #pragma omp parallel for num_threads(nthreads) schedule(static,1)
+    for (int b = 0; b < nthreads; b++) {
+      double lp[m], tempval;
+      for (int k = 0; k < m; k++) blocksum[b*m + k] = 0.0;
+      for (int i = (int)((long)b*nrow/nthreads); i < (int)((long)(b+1)*nrow/nthreads); i++) {
+        // log-probability of the path in each mixture component
+        for (int k = 0; k < m; k++) {
+          lp[k] = log(PROPORTIONS[k]);
+          for (int p = rowptr[i]; p < rowptr[i+1]; p++) lp[k] += logtheta[k*ncol + colind[p]-1];
+        }
+        // normalize the responsibilities
+        tempval = logsumexp(lp, m);
+        for (int k = 0; k < m; k++) {
+          H[k*nrow + i] = tempval == R_NegInf ? 1.0/m : exp(lp[k] - tempval);
+          blocksum[b*m + k] += H[k*nrow + i];
+        }
+      }
+    }
+
+    /*-----------------------------------------
+       M Step: Update the Path Probabilities
+    ------------------------------------------*/
+    tempval2 = 0.0;
+    for (int k = 0; k < m; k++) {
+      PROPORTIONS[k] = 0.0;
+      for (int b = 0; b < nthreads; b++) PROPORTIONS[k] += blocksum[b*m + k];
+      tempval2 = tempval2 + PROPORTIONS[k];
+    }
+    // sum the responsibilities where X[i][j] == 1
+    #pragma omp parallel for num_threads(nthreads) schedule(static)
+    for (int kj = 0; kj < m*ncol; kj++) {
+      int k = kj / ncol, j = kj % ncol;
+      double tempval = 0.0;
+      for (int p = colptr[j]; p < colptr[j+1]; p++) tempval += H[k*nrow + rowind[p]];
+      THETA[kj] = PROPORTIONS[k] > 0 ? tempval/PROPORTIONS[k] : 0.0;
+    }
+    // Normalize the mixture proportions
+    for (int k = 0; k < m; k++) PROPORTIONS[k] = PROPORTIONS[k]/tempval2;
+
+    /*-----------------------------------------
+             Check for Convergence
+    ------------------------------------------*/
+    for (int j = 0; j < m*ncol; j++) logtheta[j] = log(THETA[j]);
+    #pragma omp parallel for num_threads(nthreads) schedule(static,1)
+    for (int b = 0; b < nthreads; b++) {
+      double lp[m];
+      blockll[b] = 0.0;
+      for (int i = (int)((long)b*nrow/nthreads); i < (int)((long)(b+1)*nrow/nthreads); i++) {
+        for (int k = 0; k < m; k++) {
+          lp[k] = log(H[k*nrow + i]) + log(PROPORTIONS[k]);
+          for (int p = rowptr[i]; p < rowptr[i+1]; p++) lp[k] += logtheta[k*ncol + colind[p]-1];
+        }
+        blockll[b] += logsumexp(lp, m);
+      }
+    }
+    LIKELIHOOD[iter] = 0.0;
+    for (int b = 0; b < nthreads; b++) LIKELIHOOD[iter] += blockll[b];
+
+    if ((iter > 0 && fabs(LIKELIHOOD[iter] - LIKELIHOOD[iter-1]) < 0.001) || iter >= maxiter-1)
+      return iter + 1;
+  }
+}
+
+/* EM fit of the 3M Markov mixture model on a sparse binary path matrix, given by the (0-based)
+ * offsets ROWPTR of each row in COLIND, and the (1-based) column indices COLIND of its ones.
+ * Runs on NTHREADS threads.
+ */
+void pathMixSparse(int *ROWPTR,
+    int *COLIND,
     int *M,
     int *NOBS,
     int *NX,
@@ -205,97 +339,524 @@ void pathMix(int *X,
     double *H,
     double *THETA,
     double *PROPORTIONS,
-    double *LIKELIHOOD) 
+    double *LIKELIHOOD,
+    int *NTHREADS)
 {
-  int CONVERGED = 0;
-  int iter = 0;
   int nrow = (int)(*NOBS);
   int ncol = (int)(*NX);
   int m = (int)(*M);
-  double tempval = 0.0, tempval2 = 0.0;
-  double loglikelihood = 0.0;
+  int nthreads = npm_threads(*NTHREADS);
+  if (nthreads > nrow) nthreads = nrow > 0 ? nrow : 1;
+
+  int * colptr;
+  MALLOC(colptr,sizeof(int)*(ncol+1));
+  int * rowind;
+  MALLOC(rowind,sizeof(int)*(ROWPTR[nrow]+1));
+  double * work;
+  MALLOC(work,sizeof(double)*(m*ncol + (m+1)*nthreads));
+
+  sparse_columns(ROWPTR, COLIND, nrow, ncol, colptr, rowind);
+  *ITER = pathmix_sparse(ROWPTR, COLIND, colptr, rowind, m, nrow, ncol, *ITER,
+      H, THETA, PROPORTIONS, LIKELIHOOD, work, nthreads);
+
+  free(colptr);
+  free(rowind);
+  free(work);
+}
 
-  while (CONVERGED == 0) {
-    /*-----------------------------------------
-         E Step: Compute the responsiblities
-    ------------------------------------------*/ 
-    for (int i = 0;i < nrow;i = i + 1) {
-      
-      // for each mixture component   
-      tempval = 0.0;
-      for (int k = 0;k < m;k = k + 1) {
-        // Find the probability of a path
-        H[k*nrow + i] = PROPORTIONS[k];
-        for (int j = 0;j < ncol;j = j + 1) {
-            if (X[j*nrow + i] == 1) H[k*nrow + i] = H[k*nrow + i] * THETA[k*ncol + j];
+/* Observed-data log-likelihood of a fitted 3M model, and the entropy of its
+ * responsibilities.
+ */
+static void pathmix_criteria(const int *rowptr, const int *colind, int m, int nrow, int ncol,
+    const double *THETA, const double *PROPORTIONS, double *logtheta, double *loglik, double *entropy)
+{
+  double lp[m], tempval;
+  for (int j = 0; j < m*ncol; j++) logtheta[j] = log(THETA[j]);
+  *loglik = 0.0;
+  *entropy = 0.0;
+  for (int i = 0; i < nrow; i++) {
+    for (int k = 0; k < m; k++) {
+      lp[k] = log(PROPORTIONS[k]);
+      for (int p = rowptr[i]; p < rowptr[i+1]; p++) lp[k] += logtheta[k*ncol + colind[p]-1];
+    }
+    tempval = logsumexp(lp, m);
+    *loglik += tempval;
+    for (int k = 0; k < m; k++) {
+      double h = exp(lp[k] - tempval);
+      if (h > 0) *entropy -= h * (lp[k] - tempval);
+    }
+  }
+}
+
+/* Initial hard assignment Z of the rows of a sparse binary path matrix (see pathMixSparse) to
+ * m components, and the gene frequencies THETA within each component. Paths are assigned at
+ * random, or k-means++-style: m seed paths are drawn one at a time, with probability
+ * proportional to the squared Jaccard distance to the closest seed drawn so far, and each path
+ * is assigned to its closest seed. This takes O(nnz*m). D (nrow doubles), MARK (ncol ints) and
+ * SIZE (m ints) are workspace.
+ */
+static void pathmix_init(const int *rowptr, const int *colind, int nrow, int ncol, int m, int kmeanspp,
+    npm_rng *rng, int *z, double *THETA, double *d, int *mark, int *size, int nthreads)
+{
+  if (!kmeanspp) {
+    for (int i = 0; i < nrow; i++) z[i] = npm_unif_index(rng, m);
+  } else {
+    for (int j = 0; j < ncol; j++) mark[j] = -1;
+    for (int i = 0; i < nrow; i++) { z[i] = 0; d[i] = R_PosInf; }
+    for (int k = 0; k < m; k++) {
+      // draw the next seed
+      int s = nrow - 1;
+      double total = 0.0;
+      for (int i = 0; i < nrow; i++) total += k > 0 ? d[i]*d[i] : 1.0;
+      if (total > 0) {
+        double u = npm_unif(rng) * total;
+        for (int i = 0; i < nrow; i++) {
+          u -= k > 0 ? d[i]*d[i] : 1.0;
+          if (u < 0) { s = i; break; }
         }
-        // get the sum for that row 
-        tempval = tempval + H[k*nrow + i];
+      } else {
+        s = npm_unif_index(rng, nrow);
       }
 
-      // normalize the responsibilities
-      for (int k = 0;k < m;k = k + 1) H[k*nrow + i] = H[k*nrow + i]/tempval;
-    } 
+      // Jaccard distance of each path to the seed
+      for (int p = rowptr[s]; p < rowptr[s+1]; p++) mark[colind[p]-1] = k;
+      #pragma omp parallel for num_threads(nthreads) schedule(static)
+      for (int i = 0; i < nrow; i++) {
+        int common = 0;
+        for (int p = rowptr[i]; p < rowptr[i+1]; p++) common += mark[colind[p]-1] == k;
+        const int len = rowptr[i+1] - rowptr[i] + rowptr[s+1] - rowptr[s] - common;
+        const double dist = len > 0 ? 1.0 - (double)common/len : 0.0;
+        if (dist < d[i]) { d[i] = dist; z[i] = k; }
+      }
+    }
+  }
 
-    /*-----------------------------------------
-       M Step: Update the Path Probabilities
-    ------------------------------------------*/ 
-    // for each component
-    tempval2 = 0.0;
-    for (int k = 0;k < m;k = k + 1) {
+  // gene frequencies within the clusters
+  for (int k = 0; k < m; k++) size[k] = 0;
+  for (int j = 0; j < m*ncol; j++) THETA[j] = 0.0;
+  for (int i = 0; i < nrow; i++) {
+    size[z[i]]++;
+    for (int p = rowptr[i]; p < rowptr[i+1]; p++) THETA[z[i]*ncol + colind[p]-1] += 1.0;
+  }
+  for (int k = 0; k < m; k++) {
+    for (int j = 0; j < ncol; j++) THETA[k*ncol + j] /= size[k] > 0 ? size[k] : 1;
+  }
+}
 
-      // Update the new mixture proportions
-      PROPORTIONS[k] = 0.0;
-      for (int i = 0;i < nrow;i = i + 1) PROPORTIONS[k] = PROPORTIONS[k] + H[k*nrow + i];
-      tempval2 = tempval2 + PROPORTIONS[k];
-    
-      // for each transition
-      for (int j = 0;j < ncol;j = j + 1) {
+/* Initial theta of a path mixture model on a sparse binary path matrix (see pathMixSparse),
+ * from a random or k-means++ (INIT) assignment of paths to M components (see pathmix_init).
+ * Returns the (M x NX) theta; path probabilities and responsibilities follow from it, with
+ * equal mixture proportions, through scorePaths.
+ */
+SEXP initPathMix(SEXP ROWPTR, SEXP COLIND, SEXP NX, SEXP M, SEXP INIT, SEXP NTHREADS)
+{
+  const int *rowptr = INTEGER(ROWPTR), *colind = INTEGER(COLIND);
+  const int nrow = LENGTH(ROWPTR) - 1, ncol = Rf_asInteger(NX), m = Rf_asInteger(M);
+  const int kmeanspp = strcmp(CHAR(STRING_ELT(INIT, 0)), "kmeans++") == 0;
+  const int nthreads = npm_threads(Rf_asInteger(NTHREADS));
+  if (m == NA_INTEGER || m < 1 || nrow < 1)
+    Rf_error("Invalid number of clusters.");
+
+  SEXP THETA;
+  PROTECT( THETA = Rf_allocMatrix(REALSXP, m, ncol) );
+
+  double * theta;
+  MALLOC(theta,sizeof(double)*m*ncol);
+  double * d;
+  MALLOC(d,sizeof(double)*nrow);
+  int * z;
+  MALLOC(z,sizeof(int)*(nrow + ncol + m));
+
+  npm_rng rng;
+  npm_rng_seed(&rng, npm_seed_from_R(), 0);
+  pathmix_init(rowptr, colind, nrow, ncol, m, kmeanspp, &rng, z, theta, d, z + nrow, z + nrow + ncol, nthreads);
+  for (int k = 0; k < m; k++) {
+    for (int j = 0; j < ncol; j++) REAL(THETA)[k + (size_t)j*m] = theta[k*ncol + j];
+  }
 
-        // sum the responsibilities where X[i][j] == 1
-        tempval = 0.0;
-        for (int i = 0;i < nrow;i = i + 1) {
-          if (X[j*nrow + i] == 1.0) tempval = tempval + H[k*nrow + i];
-        }
+  free(theta);
+  free(d);
+  free(z);
 
-        // Update the new transition probability theta[k][j]
-        THETA[k*ncol + j] = tempval/PROPORTIONS[k];
-      }      
-    }
-    // Normalize the mixture proportions
-    for (int k = 0;k < m;k = k + 1) PROPORTIONS[k] = PROPORTIONS[k]/tempval2;
-  
-    /*-----------------------------------------
-             Check for Convergence 
-    ------------------------------------------*/   
-    loglikelihood = 0.0;
-    for (int i = 0;i < nrow;i = i + 1) {
-      tempval = 0.0;
-      // for each mixture component    
-      for (int k = 0;k < m;k = k + 1) {
-        // Find the probability of a path
-        tempval2 = H[k*nrow + i] * PROPORTIONS[k];
-        for (int j = 0;j < ncol;j = j + 1) {
-          if (X[j*nrow + i] == 1)  tempval2 = tempval2 * THETA[k*ncol + j];
-        }
-        // get the sum of each mixture component for that row 
-        tempval = tempval + tempval2;
-      }
-      // update the log-likelihood
-      loglikelihood = loglikelihood + log(tempval);
-    } 
-    // Store the log-likelihood
-    LIKELIHOOD[iter] = loglikelihood;
+  UNPROTECT(1);
+  return(THETA);
+}
 
+/* Random restarts of the 3M fit for each number of components in MS, on a sparse binary path
+ * matrix (see pathMixSparse). All (M, restart) runs are fitted concurrently, each on a single
+ * thread, from a random or k-means++ (INIT) assignment of paths (see pathmix_init) drawn from
+ * its own random stream, so results do not depend on the number of threads.
+ *
+ * Returns a list of the log-likelihood, the responsibility entropy and the number of iterations
+ * of each run (as length(MS) x RESTARTS matrices), and of the fit with the highest log-likelihood
+ * for each M (a list of H, THETA, PROPORTIONS, LIKELIHOOD and the restart index).
+ */
+SEXP pathMixRestarts(SEXP ROWPTR, SEXP COLIND, SEXP NX, SEXP MS, SEXP RESTARTS, SEXP ITER, SEXP INIT, SEXP NTHREADS)
+{
+  const int *rowptr = INTEGER(ROWPTR), *colind = INTEGER(COLIND), *ms = INTEGER(MS);
+  const int nrow = LENGTH(ROWPTR) - 1, ncol = Rf_asInteger(NX), nm = LENGTH(MS);
+  const int restarts = Rf_asInteger(RESTARTS), maxiter = Rf_asInteger(ITER);
+  const int nruns = nm * restarts;
+  const int kmeanspp = strcmp(CHAR(STRING_ELT(INIT, 0)), "kmeans++") == 0;
+  int nthreads = npm_threads(Rf_asInteger(NTHREADS));
+  if (nthreads > nruns) nthreads = nruns > 0 ? nruns : 1;
+
+  int mmax = 0;
+  for (int a = 0; a < nm; a++) {
+    if (ms[a] == NA_INTEGER || ms[a] < 1) Rf_error("Invalid number of clusters.");
+    if (ms[a] > mmax) mmax = ms[a];
+  }
+  if (nrow < 1 || restarts < 1 || maxiter < 1) Rf_error("Invalid arguments.");
+
+  SEXP OUT, NAMES, LOGLIK, ENTROPY, ITERS, BEST;
+  PROTECT( LOGLIK = Rf_allocMatrix(REALSXP, nm, restarts) );
+  PROTECT( ENTROPY = Rf_allocMatrix(REALSXP, nm, restarts) );
+  PROTECT( ITERS = Rf_allocMatrix(INTSXP, nm, restarts) );
+  PROTECT( BEST = NEW_LIST(nm) );
+  for (int a = 0; a < nm; a++) {
+    SEXP FIT, FITNAMES;
+    const char *names[] = {"H", "THETA", "PROPORTIONS", "LIKELIHOOD", "restart"};
+    PROTECT( FIT = NEW_LIST(5) );
+    PROTECT( FITNAMES = NEW_STRING(5) );
+    SET_VECTOR_ELT(FIT, 0, NEW_NUMERIC((R_xlen_t)nrow*ms[a]));
+    SET_VECTOR_ELT(FIT, 1, NEW_NUMERIC((R_xlen_t)ms[a]*ncol));
+    SET_VECTOR_ELT(FIT, 2, NEW_NUMERIC(ms[a]));
+    SET_VECTOR_ELT(FIT, 3, NEW_NUMERIC(maxiter));
+    SET_VECTOR_ELT(FIT, 4, Rf_ScalarInteger(NA_INTEGER));
+    for (int e = 0; e < 5; e++) SET_STRING_ELT(FITNAMES, e, Rf_mkChar(names[e]));
+    Rf_setAttrib(FIT, R_NamesSymbol, FITNAMES);
+    SET_VECTOR_ELT(BEST, a, FIT);
+    UNPROTECT(2);
+  }
 
-    if (iter > 0) {
-        if (fabs(LIKELIHOOD[iter] - LIKELIHOOD[iter-1]) < 0.001 || iter > (int)(*ITER)-1) {
-            CONVERGED = 1;
-            *ITER = iter + 1;
-        }
-    }   
-    iter = iter + 1;
+  // Output buffers of the best fits, so that threads don't touch R objects.
+  double ** best;
+  MALLOC(best,sizeof(double *)*4*nm);
+  for (int a = 0; a < nm; a++) {
+    for (int e = 0; e < 4; e++) best[4*a + e] = REAL(VECTOR_ELT(VECTOR_ELT(BEST, a), e));
   }
+  int * bestrun;
+  MALLOC(bestrun,sizeof(int)*nm);
+  for (int a = 0; a < nm; a++) bestrun[a] = -1;
+  double *loglik = REAL(LOGLIK), *entropy = REAL(ENTROPY);
+  int *iterations = INTEGER(ITERS);
+
+  // Per-thread fit buffers, and the column form of the path matrix shared by all runs.
+  const size_t hsize = (size_t)nrow*mmax, tsize = (size_t)mmax*ncol;
+  const size_t bufsize = hsize + 2*tsize + mmax + maxiter + (mmax+1);
+  double * buf;
+  MALLOC(buf,sizeof(double)*bufsize*nthreads);
+  int * zcluster;
+  MALLOC(zcluster,sizeof(int)*((size_t)nrow + mmax + ncol)*nthreads);
+  int * colptr;
+  MALLOC(colptr,sizeof(int)*(ncol+1));
+  int * rowind;
+  MALLOC(rowind,sizeof(int)*(rowptr[nrow]+1));
+  sparse_columns(rowptr, colind, nrow, ncol, colptr, rowind);
+
+  const uint64_t seed = npm_seed_from_R();
+  #pragma omp parallel for num_threads(nthreads) schedule(dynamic,1)
+  for (int u = 0; u < nruns; u++) {
+    const int a = u % nm, m = ms[a];
+    double *H = buf + bufsize*npm_thread_num(), *THETA = H + hsize, *PROPORTIONS = THETA + tsize;
+    double *LIKELIHOOD = PROPORTIONS + mmax, *work = LIKELIHOOD + maxiter;
+    int *z = zcluster + ((size_t)nrow + mmax + ncol)*npm_thread_num(), *size = z + nrow, *mark = size + mmax;
+    npm_rng rng;
+    npm_rng_seed(&rng, seed, u);
+
+    // initial assignment, using H as workspace
+    for (int k = 0; k < m; k++) PROPORTIONS[k] = 1.0/m;
+    pathmix_init(rowptr, colind, nrow, ncol, m, kmeanspp, &rng, z, THETA, H, mark, size, 1);
+
+    iterations[u] = pathmix_sparse(rowptr, colind, colptr, rowind, m, nrow, ncol, maxiter,
+        H, THETA, PROPORTIONS, LIKELIHOOD, work, 1);
+    pathmix_criteria(rowptr, colind, m, nrow, ncol, THETA, PROPORTIONS, work, &loglik[u], &entropy[u]);
+
+    // Keep the best restart, the first one on ties.
+    #pragma omp critical
+    {
+      const int b = bestrun[a];
+      if (b < 0 || loglik[u] > loglik[b] || (loglik[u] == loglik[b] && u < b)) {
+        bestrun[a] = u;
+        memcpy(best[4*a], H, sizeof(double)*nrow*m);
+        memcpy(best[4*a + 1], THETA, sizeof(double)*m*ncol);
+        memcpy(best[4*a + 2], PROPORTIONS, sizeof(double)*m);
+        for (int t = 0; t < maxiter; t++) best[4*a + 3][t] = t < iterations[u] ? LIKELIHOOD[t] : NA_REAL;
+      }
+    }
+  }
+  for (int a = 0; a < nm; a++) INTEGER(VECTOR_ELT(VECTOR_ELT(BEST, a), 4))[0] = bestrun[a] / nm + 1;
+
+  free(best);
+  free(bestrun);
+  free(buf);
+  free(zcluster);
+  free(colptr);
+  free(rowind);
+
+  PROTECT( OUT = NEW_LIST(4) );
+  PROTECT( NAMES = NEW_STRING(4) );
+  SET_VECTOR_ELT(OUT, 0, LOGLIK);	SET_STRING_ELT(NAMES, 0, Rf_mkChar("loglik"));
+  SET_VECTOR_ELT(OUT, 1, ENTROPY);	SET_STRING_ELT(NAMES, 1, Rf_mkChar("entropy"));
+  SET_VECTOR_ELT(OUT, 2, ITERS);	SET_STRING_ELT(NAMES, 2, Rf_mkChar("iterations"));
+  SET_VECTOR_ELT(OUT, 3, BEST);	SET_STRING_ELT(NAMES, 3, Rf_mkChar("best"));
+  Rf_setAttrib(OUT, R_NamesSymbol, NAMES);
+  UNPROTECT(6);
+  return(OUT);
+}
+
+/* Scores a sparse binary path matrix (see pathMixSparse) against a fitted model, given by its
+ * (M x NX) THETA and BETA matrices, with BETA NULL for pathCluster models, and its mixture
+ * PROPORTIONS. Path probabilities are computed in log-space over the ones only, so long paths do
+ * not underflow. Rows are scored concurrently.
+ *
+ * Returns a list of the (rows x M) responsibilities, normalized path probabilities and PLR
+ * probabilities (NULL without BETA), the posterior probabilities of the PLR models (NULL without
+ * BETA), the component with the highest responsibility (the first on ties), and whether several
+ * components share it.
+ */
+SEXP scorePaths(SEXP ROWPTR, SEXP COLIND, SEXP THETA, SEXP BETA, SEXP PROPORTIONS, SEXP NTHREADS)
+{
+	const int nrow = LENGTH(ROWPTR) - 1, m = Rf_nrows(THETA), ncol = Rf_ncols(THETA);
+	const int *rowptr = INTEGER(ROWPTR), *colind = INTEGER(COLIND);
+	const int plr = !Rf_isNull(BETA);
+	const int nthreads = npm_threads(Rf_asInteger(NTHREADS));
+	const double *beta = plr ? REAL(BETA) : NULL, *proportions = REAL(PROPORTIONS);
+
+	if (LENGTH(PROPORTIONS) != m || (plr && (Rf_nrows(BETA) != m || Rf_ncols(BETA) != ncol)))
+		Rf_error("Invalid model parameters.");
+	for (int p = 0;p < rowptr[nrow];p = p + 1) {
+		if (colind[p] == NA_INTEGER || colind[p] < 1 || colind[p] > ncol)
+			Rf_error("Paths have genes outside the model.");
+	}
+
+	SEXP OUT, NAMES, H, PATHPROBS, PLRPRE, POST, LABELS, TIES;
+	PROTECT( H = Rf_allocMatrix(REALSXP, nrow, m) );
+	PROTECT( PATHPROBS = Rf_allocMatrix(REALSXP, nrow, m) );
+	PROTECT( PLRPRE = plr ? Rf_allocMatrix(REALSXP, nrow, m) : R_NilValue );
+	PROTECT( POST = plr ? NEW_NUMERIC(nrow) : R_NilValue );
+	PROTECT( LABELS = NEW_INTEGER(nrow) );
+	PROTECT( TIES = NEW_LOGICAL(nrow) );
+	double *h = REAL(H), *pathprobs = REAL(PATHPROBS), *plrpre = plr ? REAL(PLRPRE) : NULL;
+	double *post = plr ? REAL(POST) : NULL;
+	int *labels = INTEGER(LABELS), *ties = LOGICAL(TIES);
+
+	// log(theta), with the components of a gene contiguous
+	double * logtheta;
+	MALLOC(logtheta,sizeof(double)*m*ncol);
+	for (int j = 0;j < m*ncol;j = j + 1) logtheta[j] = log(REAL(THETA)[j]);
+
+	#pragma omp parallel for num_threads(nthreads) schedule(static)
+	for (int i = 0;i < nrow;i = i + 1) {
+		double lp[m], lh[m], tempval, tempval2;
+
+		// log path probabilities, and PLR predictions
+		for (int k = 0;k < m;k = k + 1) {
+			lp[k] = 0.0;
+			tempval = 0.0;
+			for (int p = rowptr[i];p < rowptr[i+1];p = p + 1) {
+				lp[k] = lp[k] + logtheta[(colind[p]-1)*m + k];
+				if (plr) tempval = tempval + beta[(colind[p]-1)*m + k];
+			}
+			lh[k] = log(proportions[k]) + lp[k];
+			if (plr) {
+				plrpre[k*nrow + i] = 1/(1+exp(-tempval));
+				lh[k] = lh[k] + log(plrpre[k*nrow + i]);
+			}
+		}
+
+		// normalize, as 0/0 when no component can generate the path
+		tempval = logsumexp(lp, m);
+		tempval2 = logsumexp(lh, m);
+		labels[i] = NA_INTEGER;
+		ties[i] = 0;
+		if (plr) post[i] = 0.0;
+		for (int k = 0;k < m;k = k + 1) {
+			pathprobs[k*nrow + i] = tempval == R_NegInf ? R_NaN : exp(lp[k] - tempval);
+			h[k*nrow + i] = tempval2 == R_NegInf ? R_NaN : exp(lh[k] - tempval2);
+			if (plr) post[i] = post[i] + pathprobs[k*nrow + i]*plrpre[k*nrow + i];
+
+			if (tempval2 == R_NegInf) continue;
+			if (labels[i] == NA_INTEGER || h[k*nrow + i] > h[(labels[i]-1)*nrow + i]) {
+				labels[i] = k + 1;
+				ties[i] = 0;
+			} else if (h[k*nrow + i] == h[(labels[i]-1)*nrow + i]) {
+				ties[i] = 1;
+			}
+		}
+	}
+	free(logtheta);
+
+	PROTECT( OUT = NEW_LIST(6) );
+	PROTECT( NAMES = NEW_STRING(6) );
+	SET_VECTOR_ELT(OUT, 0, H);	SET_STRING_ELT(NAMES, 0, Rf_mkChar("h"));
+	SET_VECTOR_ELT(OUT, 1, PATHPROBS);	SET_STRING_ELT(NAMES, 1, Rf_mkChar("path.probabilities"));
+	SET_VECTOR_ELT(OUT, 2, PLRPRE);	SET_STRING_ELT(NAMES, 2, Rf_mkChar("plr.probabilities"));
+	SET_VECTOR_ELT(OUT, 3, POST);	SET_STRING_ELT(NAMES, 3, Rf_mkChar("posterior.probs"));
+	SET_VECTOR_ELT(OUT, 4, LABELS);	SET_STRING_ELT(NAMES, 4, Rf_mkChar("labels"));
+	SET_VECTOR_ELT(OUT, 5, TIES);	SET_STRING_ELT(NAMES, 5, Rf_mkChar("ties"));
+	Rf_setAttrib(OUT, R_NamesSymbol, NAMES);
+	UNPROTECT(8);
+	return(OUT);
+}
+
+irls_sparse * irls_sparse_alloc(const double *x, int nobs, int nx)
+{
+	irls_sparse * xs;
+	MALLOC(xs,sizeof(irls_sparse));
+	size_t nnz = 0;
+	for (size_t i = 0;i < (size_t)nobs*nx;i = i + 1) if (x[i] != 0.0) nnz = nnz + 1;
+	MALLOC(xs->colptr,sizeof(int)*(nx+1));
+	MALLOC(xs->rowind,sizeof(int)*(nnz+1));
+	MALLOC(xs->val,sizeof(double)*(nnz+1));
+
+	nnz = 0;
+	for (int j = 0;j < nx;j = j + 1) {
+		xs->colptr[j] = nnz;
+		for (int i = 0;i < nobs;i = i + 1) {
+			if (x[(size_t)j*nobs + i] != 0.0) {
+				xs->rowind[nnz] = i;
+				xs->val[nnz] = x[(size_t)j*nobs + i];
+				nnz = nnz + 1;
+			}
+		}
+	}
+	xs->colptr[nx] = nnz;
+	return xs;
+}
+
+void irls_sparse_free(irls_sparse * xs)
+{
+	free(xs->colptr);
+	free(xs->rowind);
+	free(xs->val);
+	free(xs);
+}
+
+irls_workspace * irls_workspace_alloc(int nobs, int nx, const irls_sparse *xs)
+{
+	irls_workspace * ws;
+	MALLOC(ws,sizeof(irls_workspace));
+	ws->nobs = nobs;
+	ws->nx = nx;
+	ws->xs = xs;
+	MALLOC(ws->weights,sizeof(double)*nobs); // HME3M weights
+	MALLOC(ws->rss,sizeof(double)*nobs); // residual sums of squares vectory
+	MALLOC(ws->bret,sizeof(double)*nx); // temporary beta information vector
+	if (xs == NULL) {
+		MALLOC(ws->cov,sizeof(double)*nx*nx);  // Covariance matrix
+		MALLOC(ws->XW,sizeof(double)*nobs*nx); // temporary sqrt(weights)*X
+		MALLOC(ws->ipiv,sizeof(int)*nx);
+		ws->cg = NULL;
+	} else {
+		MALLOC(ws->cg,sizeof(double)*(3*nx + nobs)); // conjugate gradient vectors
+		ws->cov = NULL;
+		ws->XW = NULL;
+		ws->ipiv = NULL;
+	}
+	return ws;
+}
+
+void irls_workspace_free(irls_workspace * ws)
+{
+	free(ws->cov);
+	free(ws->weights);
+	free(ws->XW);
+	free(ws->rss);
+	free(ws->bret);
+	free(ws->ipiv);
+	free(ws->cg);
+	free(ws);
+}
+
+// out = X %*% v
+static void irls_xv(const irls_workspace * ws, const double *x, const double *v, double *out)
+{
+	char *dont_transpose = "N";
+	double double_zero = 0.0, double_one = 1.0;
+	int int_one = 1, nobs = ws->nobs, nx = ws->nx;
+	const irls_sparse * xs = ws->xs;
+
+	if (xs == NULL) {
+		F77_NAME(dgemv)(dont_transpose, &nobs, &nx, &double_one, x, &nobs, v, &int_one, &double_zero, out, &int_one FCONE);
+		return;
+	}
+	for (int i = 0;i < nobs;i = i + 1) out[i] = 0.0;
+	for (int j = 0;j < nx;j = j + 1) {
+		if (v[j] == 0.0) continue;
+		for (int p = xs->colptr[j];p < xs->colptr[j+1];p = p + 1) out[xs->rowind[p]] += xs->val[p]*v[j];
+	}
+}
+
+// out = t(X) %*% u
+static void irls_xtv(const irls_workspace * ws, const double *x, const double *u, double *out)
+{
+	char *transpose = "T";
+	double double_zero = 0.0, double_one = 1.0;
+	int int_one = 1, nobs = ws->nobs, nx = ws->nx;
+	const irls_sparse * xs = ws->xs;
+
+	if (xs == NULL) {
+		F77_NAME(dgemv)(transpose, &nobs, &nx, &double_one, x, &nobs, u, &int_one, &double_zero, out, &int_one FCONE);
+		return;
+	}
+	for (int j = 0;j < nx;j = j + 1) {
+		double tempval = 0.0;
+		for (int p = xs->colptr[j];p < xs->colptr[j+1];p = p + 1) tempval += xs->val[p]*u[xs->rowind[p]];
+		out[j] = tempval;
+	}
+}
+
+// cov = t(X) %*% W %*% X + L, upper triangle only
+static void irls_information(irls_workspace * ws, double lambda)
+{
+	char *transpose = "T", *upper_triangle = "U";
+	double double_zero = 0.0, double_one = 1.0;
+	int nobs = ws->nobs, nx = ws->nx;
+
+	F77_NAME(dsyrk)(upper_triangle, transpose, &nx, &nobs, &double_one, ws->XW, &nobs, &double_zero, ws->cov, &nx FCONE FCONE);
+	for (int i = 0;i < nx;i = i + 1) ws->cov[i*nx + i] = ws->cov[i*nx + i] + lambda;
+}
+
+/* Solves (t(X) %*% W %*% X + L) b = bret in place by conjugate gradients, with sparse products
+ * by X and t(X), so the matrix is never formed. Stops when the residual norm falls below 1e-10
+ * of its initial value, or after 10*nx iterations.
+ */
+static void irls_cg(irls_workspace * ws, double lambda)
+{
+	int nx = ws->nx, nobs = ws->nobs;
+	double *r = ws->cg, *p = r + nx, *q = p + nx, *u = q + nx, *b = ws->bret;
+	double rr = 0.0, rr0, tempval;
+
+	for (int j = 0;j < nx;j = j + 1) {
+		r[j] = b[j];
+		p[j] = b[j];
+		b[j] = 0.0;
+		rr = rr + r[j]*r[j];
+	}
+	rr0 = rr;
+	for (int iter = 0;iter < 10*nx && rr > 1e-20*rr0;iter = iter + 1) {
+		// q = (t(X) %*% W %*% X + L) %*% p
+		irls_xv(ws, NULL, p, u);
+		for (int i = 0;i < nobs;i = i + 1) u[i] = u[i]*ws->weights[i];
+		irls_xtv(ws, NULL, u, q);
+		tempval = 0.0;
+		for (int j = 0;j < nx;j = j + 1) {
+			q[j] = q[j] + lambda*p[j];
+			tempval = tempval + p[j]*q[j];
+		}
+		if (tempval <= 0.0) break;
+
+		tempval = rr/tempval;
+		double rrnew = 0.0;
+		for (int j = 0;j < nx;j = j + 1) {
+			b[j] = b[j] + tempval*p[j];
+			r[j] = r[j] - tempval*q[j];
+			rrnew = rrnew + r[j]*r[j];
+		}
+		for (int j = 0;j < nx;j = j + 1) p[j] = r[j] + (rrnew/rr)*p[j];
+		rr = rrnew;
+	}
 }
 
 void irls(double *y, 
@@ -307,7 +868,8 @@ void irls(double *y,
 	double *ypre,	
 	double lambda,
 	double alpha,
-	int maxiter) 
+	int maxiter,
+	irls_workspace *ws) 
 {
 	int i,k,iter;
 	int NotConverged = 1;
@@ -316,37 +878,16 @@ void irls(double *y,
 	double tempval = 0.0;
 	double tempval2 = 0.0;
 	
-	char *transpose = "T", *dont_transpose = "N";
-	//char *upper_triangle = "U", *left_side = "L";
-	//char *non_unit = "N";
-	double double_zero = 0.0, double_one = 1.0;
+	char *dont_transpose = "N", *upper_triangle = "U";
 	int int_one = 1,info = 0;
 	
-	double * cov;
-	MALLOC(cov,sizeof(double)*nx*nx);  // Covariance matrix
-	double * weights;  
-	MALLOC(weights,sizeof(double)*nobs); // HME3M weights
-	double * XW;
-	MALLOC(XW,sizeof(double)*nobs*nx); // temporary X*weights
-	double * rss;
-	MALLOC(rss,sizeof(double)*nobs); // residual sums of squares vectory
-	double * bret;
-	MALLOC(bret,sizeof(double)*nx); // temporary beta information vector
-    double * btemp;
-    MALLOC(btemp,sizeof(double)*nx);
-    
-    int *ipiv;
-    MALLOC(ipiv,sizeof(int)*nx*nx);
-
-    double *work;
-    MALLOC(work,sizeof(double)*100*nx);  // Following IBMs recommendations
-    int lwork = 100*nx;
+	double *cov = ws->cov, *weights = ws->weights, *XW = ws->XW, *rss = ws->rss, *bret = ws->bret;
 
 	//Compute the initial likelihood ypre = XB
 	likelihood = 0.0;
 	
 	// ypre = X %*% B
-	F77_NAME(dgemv)(dont_transpose, &nobs, &nx, &double_one, x, &nobs, beta, &int_one, &double_zero, ypre, &int_one FCONE);
+	irls_xv(ws, x, beta, ypre);
     
 	for (i = 0;i < nobs;i = i + 1) {
 		tempval = ypre[i]; 
@@ -360,36 +901,44 @@ void irls(double *y,
 	
 	iter = 0;
 	while (NotConverged == 1) {
-		for (i = 0;i < nobs;i = i + 1) {
-			for (k = 0;k < nx;k = k + 1) {
-				XW[k*nobs + i] = x[k*nobs + i] * weights[i];
-			}
-		}
-					
-		// t(X) %*% W %*% X
-		F77_NAME(dgemm)(transpose, dont_transpose,&nx,&nx,&nobs,&double_one, XW, &nobs, x, &nobs, &double_zero, cov, &nx FCONE FCONE); 
-
-		//cov = t(X) %*% W %*% X + L
-		for (i = 0;i < nx;i = i + 1) cov[i*nx + i] = cov[i*nx + i] + lambda;
-
 		// Compute w*(y - ypre)
 		for (i = 0;i < nobs;i = i + 1) rss[i] = w[i]*(y[i] - ypre[i]);
 			
-		// btemp = t(x)*(w*(y - ypre))
-		F77_NAME(dgemv)(transpose, &nobs, &nx, &double_one, x, &nobs, rss, &int_one, &double_zero, btemp, &int_one FCONE);
+		// bret = t(x)*(w*(y - ypre))
+		irls_xtv(ws, x, rss, bret);
 
-    // (t(X) %*% W %*% X)^(-1)
-    F77_CALL(dgetrf)(&nx,&nx,cov,&nx,ipiv,&info);
-    F77_NAME(dgetri)(&nx,cov,&nx,ipiv,work,&lwork,&info);
+		// bret = (t(X) %*% W %*% X + L)^(-1) %*% t(X) %*% W * (y - ypre)
+		if (ws->xs != NULL) {
+			irls_cg(ws, lambda);
+		} else {
+			for (i = 0;i < nobs;i = i + 1) {
+				tempval = sqrt(weights[i]);
+				for (k = 0;k < nx;k = k + 1) {
+					XW[k*nobs + i] = x[k*nobs + i] * tempval;
+				}
+			}
 
-    // (t(X) %*% W %*% X)^(-1) %*% t(X) %*% W * (y - ypre)
-    F77_NAME(dgemv)(dont_transpose, &nx, &nx, &double_one, cov, &nx, btemp, &int_one, &double_zero, bret, &int_one FCONE);
+			//cov = t(X) %*% W %*% X + L
+			irls_information(ws, lambda);
+
+			// Solve by Cholesky. Without a ridge penalty the matrix can be singular, so fall back to LU.
+			F77_CALL(dpotrf)(upper_triangle, &nx, cov, &nx, &info FCONE);
+			if (info == 0) {
+				F77_CALL(dpotrs)(upper_triangle, &nx, &int_one, cov, &nx, bret, &nx, &info FCONE);
+			} else {
+				irls_information(ws, lambda);
+				for (i = 0;i < nx;i = i + 1)
+					for (k = 0;k < i;k = k + 1) cov[k*nx + i] = cov[i*nx + k];
+				F77_CALL(dgetrf)(&nx,&nx,cov,&nx,ws->ipiv,&info);
+				F77_CALL(dgetrs)(dont_transpose,&nx,&int_one,cov,&nx,ws->ipiv,bret,&nx,&info FCONE);
+			}
+		}
 
 		// beta = beta + bupdate
 		for (i = 0;i < nx;i = i + 1) beta[i] = beta[i] + alpha*bret[i];
 
 		// ypre = XB
-		F77_NAME(dgemv)(dont_transpose, &nobs, &nx, &double_one, x, &nobs, beta, &int_one, &double_zero, ypre, &int_one FCONE);
+		irls_xv(ws, x, beta, ypre);
 		
 		//Compute the new likelihood
 		NEWlikelihood = 0.0;
@@ -405,12 +954,4 @@ void irls(double *y,
 		likelihood = NEWlikelihood;
 		iter = iter+1;
 	}
-
-	free(cov);
-	free(weights);
-	free(XW);
-	free(bret);
-	free(rss);
-    free(ipiv);
-    free(work);
 }
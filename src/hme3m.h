@@ -29,8 +29,41 @@ void hme3m(double * y,
 	double * beta ,
 	double * PROPORTIONS,
 	double * HMEPRE,
-	double * LIKELIHOOD);
+	double * LIKELIHOOD,
+	int nthreads);
 	
+/* Number of columns above which irls solves by conjugate gradients, with products
+ * by a sparse copy of X, rather than by forming and factorizing t(X) %*% W %*% X.
+ */
+#ifndef IRLS_SPARSE_NX
+#define IRLS_SPARSE_NX 2000
+#endif
+
+// X in compressed sparse column form.
+typedef struct {
+	int *colptr;
+	int *rowind;
+	double *val;
+} irls_sparse;
+
+// Workspace of irls, allocated once per model fit. xs is NULL for dense solves.
+typedef struct {
+	int nobs, nx;
+	const irls_sparse *xs;
+	double *cov;
+	double *weights;
+	double *XW;
+	double *rss;
+	double *bret;
+	int *ipiv;
+	double *cg;
+} irls_workspace;
+
+irls_sparse * irls_sparse_alloc(const double *x, int nobs, int nx);
+void irls_sparse_free(irls_sparse * xs);
+irls_workspace * irls_workspace_alloc(int nobs, int nx, const irls_sparse *xs);
+void irls_workspace_free(irls_workspace * ws);
+
 void irls(double *y, 
 	double *x,
 	int nobs,
@@ -40,6 +73,7 @@ void irls(double *y,
 	double *ypre,	
 	double lambda,
 	double alpha,
-	int maxiter);
+	int maxiter,
+	irls_workspace *ws);
 
 #endif
@@ -14,13 +14,29 @@ static const R_CallMethodDef callMethods[] = {
 #endif
 
 	ENTRY(expand_complexes, 5),
+	ENTRY(labelEdgeWeights, 9),
+	ENTRY(aggregateEdgeWeights, 8),
+	ENTRY(geneConnections, 3),
+	ENTRY(writeExprMatrix, 3),
+	ENTRY(mapExprMatrix, 1),
+	ENTRY(readExprMatrix, 1),
+	ENTRY(edgeWeightKeys, 7),
+	ENTRY(readWeightCache, 3),
+	ENTRY(writeWeightCache, 3),
+	ENTRY(pathranker, 7),
+	ENTRY(prepareRankNetwork, 8),
+	ENTRY(samplepaths, 8),
+	ENTRY(scope, 7),
+	ENTRY(binaryPaths, 2),
+	ENTRY(initPathMix, 6),
+	ENTRY(pathMixRestarts, 8),
+	ENTRY(scorePaths, 6),
 	{NULL, NULL, 0}
 };
 
 static const R_CMethodDef cmethods[] = {
-	ENTRY(corEdgeWeights, 7),
-	ENTRY(hme3m_R, 17),
-	ENTRY(pathMix, 9),
+	ENTRY(hme3m_R, 18),
+	ENTRY(pathMixSparse, 11),
 	{NULL, NULL, 0}
 };
 
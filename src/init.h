@@ -26,10 +26,13 @@ using namespace std;
 void hme3m_R(double *Y, double *X, int *M, double *LAMBDA, double *ALPHA, int *NOBS,
 			int *NX, int *HME3MITER, int *PLRITER, double *H, double *PATHPROBS,
 			double *PLRPRE, double *THETA, double *BETA, double *PROPORTIONS,
-			double *HMEPRE, double *LIKELIHOOD);
+			double *HMEPRE, double *LIKELIHOOD, int *NTHREADS);
 
-void pathMix(int *X, int *M, int *NOBS, int *NX, int *ITER, double *H,
-			double *THETA, double *PROPORTIONS, double *LIKELIHOOD);
+void pathMixSparse(int *ROWPTR, int *COLIND, int *M, int *NOBS, int *NX, int *ITER,
+			double *H, double *THETA, double *PROPORTIONS, double *LIKELIHOOD, int *NTHREADS);
+SEXP initPathMix(SEXP ROWPTR, SEXP COLIND, SEXP NX, SEXP M, SEXP INIT, SEXP NTHREADS);
+SEXP pathMixRestarts(SEXP ROWPTR, SEXP COLIND, SEXP NX, SEXP MS, SEXP RESTARTS, SEXP ITER, SEXP INIT, SEXP NTHREADS);
+SEXP scorePaths(SEXP ROWPTR, SEXP COLIND, SEXP THETA, SEXP BETA, SEXP PROPORTIONS, SEXP NTHREADS);
 
 
 
@@ -47,13 +50,25 @@ extern "C" {
 #endif
 
 SEXP expand_complexes(SEXP ATTR_LS, SEXP EL, SEXP V, SEXP EXPAND, SEXP MISSING);
-SEXP pathranker(SEXP node_list, SEXP edge_list, SEXP edge_weights, SEXP rk, SEXP minpathsize);
-SEXP scope(SEXP node_list, SEXP edge_list, SEXP edge_weights, SEXP SAMPLEDPATHS, SEXP ALPHA, SEXP ECHO);
+SEXP labelEdgeWeights(SEXP X, SEXP EL, SEXP SAMEG, SEXP LABELS, SEXP NLABELS, SEXP NCOR,
+		SEXP METHOD, SEXP SUBSET, SEXP NTHREADS);
+SEXP aggregateEdgeWeights(SEXP W, SEXP ID, SEXP SAMEG, SEXP NEDGES,
+		SEXP COMPLEX, SEXP MISSING, SEXP SAMEGENE, SEXP NTHREADS);
+SEXP geneConnections(SEXP EL, SEXP GENES, SEXP ROWNAMES);
+SEXP writeExprMatrix(SEXP X, SEXP FILENAME, SEXP TYPE);
+SEXP mapExprMatrix(SEXP FILENAME);
+SEXP readExprMatrix(SEXP PTR);
+SEXP edgeWeightKeys(SEXP X, SEXP EL, SEXP SAMEG, SEXP LABELS, SEXP NLABELS, SEXP OPTIONS, SEXP NTHREADS);
+SEXP readWeightCache(SEXP FILENAME, SEXP KEYS, SEXP NCONN);
+SEXP writeWeightCache(SEXP FILENAME, SEXP KEYS, SEXP WEIGHTS);
+SEXP pathranker(SEXP node_list, SEXP edge_list, SEXP edge_weights, SEXP rk, SEXP minpathsize,
+		SEXP nthreads, SEXP compact);
+SEXP prepareRankNetwork(SEXP EL, SEXP NV, SEXP W, SEXP START, SEXP END, SEXP SCALE,
+		SEXP NORMALIZE, SEXP NTHREADS);
+SEXP binaryPaths(SEXP OFFSETS, SEXP IDS);
+SEXP scope(SEXP EDGE_WEIGHTS, SEXP EIDS, SEXP EOFFSETS, SEXP LABEL, SEXP NPERM, SEXP ALPHA, SEXP NTHREADS);
 SEXP samplepaths(SEXP node_list, SEXP edge_list, SEXP edge_weights, SEXP MAXPATHLENGTH,
-				SEXP SAMPLEPATHS, SEXP WARMUPSTEPS);
-
-void corEdgeWeights(double * X, int * EDGELIST, int * SAMEGENE,	double * WEIGHT,
-					int *NEDGES, int * NOBS, int * NCOR);
+				SEXP SAMPLEPATHS, SEXP WARMUPSTEPS, SEXP NCHAINS, SEXP NTHREADS);
 
 #ifdef __cplusplus
 }
@@ -1,4 +1,6 @@
 #include "init.h"
+#include "parallel.h"
+#include "exprmatrix.h"
 
 
 template <class T>
@@ -15,85 +17,1067 @@ typename vector<T>::size_type add_elem(vector<T> &v,const T &e){
 	return pos;
 }
 
-int compare (const void * a, const void * b)
-{
-  return ( *(double*)a - *(double*)b );
-}
+// Median of the non-missing values of x, using linear time selection. x is reordered.
 double median(double x[], int n) {
+    int m = 0;
+    for (int i = 0; i < n; i++) if (!std::isnan(x[i])) x[m++] = x[i];
+    n = m;
+
     if(n==0){return(NA_REAL);}
     if(n==1){return(x[0]);}
 
-
-    qsort(x, n, sizeof(x[0]), compare);
+    nth_element(x, x + n/2, x + n);
     if(n%2==0) {
-        // if there is an even number of elements, return mean of the two elements in the middle
-        return((x[n/2] + x[n/2 - 1]) / 2.0);
+        // if there is an even number of elements, return mean of the two elements in the middle.
+        // The lower one is the largest element of the (partitioned) lower half.
+        return((x[n/2] + *max_element(x, x + n/2)) / 2.0);
     } else {
         // else return the element in the middle
         return x[n/2];
     }
 }
 
-void corEdgeWeights(double * X,
-    int * EDGELIST,
-    int * SAMEGENE,
-    double * WEIGHT,
-    int *NEDGES,
-    int * NOBS,
-    int * NCOR)
+static inline double cor_from_sums(double n, double Ex, double Ey, double Exx, double Eyy, double Exy)
+{
+    double vx = n*Exx - Ex*Ex, vy = n*Eyy - Ey*Ey;
+    if (n <= 2 || vx <= 0.0 || vy <= 0.0) return NA_REAL;
+    return (n*Exy - Ex*Ey)/ sqrt(vx * vy);
+}
+
+static inline double weighted_dot(const double * w, const double * x, int n)
+{
+    double a = 0.0;
+    #pragma omp simd reduction(+:a)
+    for (int i = 0; i < n; i++) a += w[i]*x[i];
+    return a;
+}
+
+/* Bootstrap resampling engine.
+ *
+ * The NCOR resamples (with replacement) of the sample columns are drawn once, from a
+ * per-replicate random stream, and stored as multiplicity vectors: counts[r*nobs + i] is
+ * the number of times sample i is drawn in replicate r. All edges are evaluated on the
+ * same resamples, so the per-replicate sums and sums of squares of a gene row are computed
+ * once and shared by all of its edges; only the cross products are computed per edge.
+ */
+class Bootstrap {
+public:
+    int nrep, nobs;
+    vector<double> counts;
+
+    Bootstrap(int nrep, int nobs, uint64_t seed): nrep(nrep), nobs(nobs), counts((size_t)nrep*nobs, 0.0) {
+        for (int r = 0; r < nrep; r++) {
+            npm_rng rng;
+            npm_rng_seed(&rng, seed, (uint64_t)r);
+            for (int i = 0; i < nobs; i++) counts[(size_t)r*nobs + npm_unif_index(&rng, nobs)] += 1.0;
+        }
+    }
+    const double * rep(int r) const { return &counts[(size_t)r*nobs]; }
+
+    // Per-replicate sums of a row without missing values.
+    void row_stats(const double * x, double * sum, double * sumsq, double * buf) const {
+        for (int i = 0; i < nobs; i++) buf[i] = x[i]*x[i];
+        for (int r = 0; r < nrep; r++) {
+            sum[r] = weighted_dot(rep(r), x, nobs);
+            sumsq[r] = weighted_dot(rep(r), buf, nobs);
+        }
+    }
+};
+
+/* Genes taking part in the edges, other than NA and same-gene edges, each listed once:
+ * gene_pos maps a gene row to its position in genes, or -1.
+ */
+struct EdgeGenes {
+    vector<int> gene_pos, genes;
+
+    EdgeGenes(const int * EDGELIST, const int * SAMEGENE, int nedges) {
+        int maxgene = -1;
+        for (int indx = 0; indx < nedges; indx++) {
+            maxgene = max(maxgene, max(EDGELIST[indx], EDGELIST[indx+nedges]));
+        }
+        gene_pos.assign(maxgene + 1, -1);
+        for (int indx = 0; indx < nedges; indx++) {
+            int from_indx = EDGELIST[indx], to_indx = EDGELIST[indx+nedges];
+            if(to_indx == NA_INTEGER || from_indx == NA_INTEGER || SAMEGENE[indx] != 0) continue;
+            if(gene_pos[from_indx] < 0){ gene_pos[from_indx] = genes.size(); genes.push_back(from_indx); }
+            if(gene_pos[to_indx] < 0){ gene_pos[to_indx] = genes.size(); genes.push_back(to_indx); }
+        }
+    }
+};
+
+// Whether each row of GENES has no missing value. Each row is scanned once, concurrently.
+static vector<char> complete_rows(const double * X, size_t ld, int nobs, const vector<int> &genes, int nthreads)
+{
+    const int ngenes = genes.size();
+    vector<char> complete(ngenes, 1);
+
+    #pragma omp parallel for schedule(static) num_threads(nthreads)
+    for (int g = 0; g < ngenes; g++) {
+        const double * x = X + (size_t)genes[g]*ld;
+        for (int i = 0; i < nobs; i++) {
+            if (std::isnan(x[i])) { complete[g] = 0; break; }
+        }
+    }
+    return complete;
+}
+
+static inline bool all_complete(const vector<char> &complete)
+{
+    return find(complete.begin(), complete.end(), 0) == complete.end();
+}
+
+/* Pearson correlation edge weights (optionally bootstrapped).
+ *
+ * Gene rows are read from a row-major block X, gene g starting at X[g*ld]; EDGELIST holds
+ * the from (first nedges) and to (last nedges) rows of each edge. EG lists the genes of the
+ * edges, and COMPLETE whether their rows are complete (see complete_rows).
+ */
+static void pearsonBoot(const double * X, size_t ld, int nobs,
+    const int * EDGELIST, const int * SAMEGENE, double * WEIGHT, int nedges,
+    const EdgeGenes &eg, const vector<char> &complete, int ncor, uint64_t seed, int nthreads)
 {
-    int nobs = (int)(*NOBS);
-    int nedges = (int)(*NEDGES);
-    const int ncor = (int)(*NCOR);
-    int indx, i;
+    ncor = max(ncor, 1);
+    const bool bootstrap = ncor > 1;
+    const Bootstrap boot(bootstrap ? ncor : 0, nobs, seed);
+    const vector<int> &gene_pos = eg.gene_pos, &genes = eg.genes;
+    const int ngenes = genes.size();
+
+    // Shared per-gene, per-replicate sufficient statistics for complete rows.
+    vector<double> gsum, gsumsq;
+    if (bootstrap) {
+        gsum.assign((size_t)ngenes*ncor, 0.0);
+        gsumsq.assign((size_t)ngenes*ncor, 0.0);
+
+        #pragma omp parallel num_threads(nthreads)
+        {
+            vector<double> buf(nobs);
+
+            #pragma omp for schedule(static)
+            for (int g = 0; g < ngenes; g++) {
+                if (complete[g])
+                    boot.row_stats(X + (size_t)genes[g]*ld, &gsum[(size_t)g*ncor], &gsumsq[(size_t)g*ncor], &buf[0]);
+            }
+        }
+    }
 
     // For each edge
-    for (indx = 0;indx < nedges;indx = indx + 1) {
-        int to_indx = EDGELIST[indx+nedges];
-        int from_indx = EDGELIST[indx];
+    #pragma omp parallel num_threads(nthreads)
+    {
+        vector<double> corlist(ncor), xy(nobs), mx(nobs), my(nobs), mxx(nobs), myy(nobs), mask(nobs);
+
+        #pragma omp for schedule(dynamic, 64)
+        for (int indx = 0;indx < nedges;indx = indx + 1) {
+            int to_indx = EDGELIST[indx+nedges];
+            int from_indx = EDGELIST[indx];
+
+            if(to_indx == NA_INTEGER || from_indx == NA_INTEGER){
+                WEIGHT[indx] = NA_REAL;
+                continue;
+            }
+
+            WEIGHT[indx] = 0.0; // if all else fails the weight will be assigned to 0
+
+            if (SAMEGENE[indx] != 0) {
+                // If it is the same gene set to minimum of -1.0 (penalty)
+                WEIGHT[indx] = -1.0;
+                continue;
+            }
+
+            const double * x = X + (size_t)from_indx*ld;
+            const double * y = X + (size_t)to_indx*ld;
+            const int gx = gene_pos[from_indx], gy = gene_pos[to_indx];
+
+            if (!bootstrap) {
+                double Exy = 0.0, Exx = 0.0, Ex = 0.0, Eyy = 0.0, Ey = 0.0;
+                double n = (double)nobs;
+                for (int i = 0;i < nobs;i = i + 1) {
+                    double xp = x[i], yp = y[i];
+                    if (!std::isnan(xp) && !std::isnan(yp)) {
+                        Ex = Ex + xp; Exx = Exx + xp*xp; Ey = Ey + yp; Eyy = Eyy + yp*yp; Exy = Exy + xp*yp;
+                    } else n = n - 1.0; // If it is a missing value skip that observation completely and reduce the dataset size by 1.
+                }
+                corlist[0] = cor_from_sums(n, Ex, Ey, Exx, Eyy, Exy);
+
+            } else if (complete[gx] && complete[gy]) {
+                // Only the cross products are edge specific.
+                for (int i = 0; i < nobs; i++) xy[i] = x[i]*y[i];
+                const double * sx = &gsum[(size_t)gx*ncor], * sxx = &gsumsq[(size_t)gx*ncor];
+                const double * sy = &gsum[(size_t)gy*ncor], * syy = &gsumsq[(size_t)gy*ncor];
+                for (int r = 0; r < ncor; r++)
+                    corlist[r] = cor_from_sums(nobs, sx[r], sy[r], sxx[r], syy[r], weighted_dot(boot.rep(r), &xy[0], nobs));
+
+            } else {
+                // Missing values: sums are restricted to the samples observed in both genes.
+                for (int i = 0; i < nobs; i++) {
+                    bool obs = !std::isnan(x[i]) && !std::isnan(y[i]);
+                    mask[i] = obs; mx[i] = obs ? x[i] : 0.0; my[i] = obs ? y[i] : 0.0;
+                    mxx[i] = mx[i]*mx[i]; myy[i] = my[i]*my[i]; xy[i] = mx[i]*my[i];
+                }
+                for (int r = 0; r < ncor; r++) {
+                    const double * w = boot.rep(r);
+                    corlist[r] = cor_from_sums(weighted_dot(w, &mask[0], nobs),
+                            weighted_dot(w, &mx[0], nobs), weighted_dot(w, &my[0], nobs),
+                            weighted_dot(w, &mxx[0], nobs), weighted_dot(w, &myy[0], nobs),
+                            weighted_dot(w, &xy[0], nobs));
+                }
+            }
+
+            //If multiple correlations, take the median.
+            double med = median(&corlist[0], ncor);
+            if (!std::isnan(med)) WEIGHT[indx] = med;
+        }
+    }
+}
+
+/* Pearson correlation through standardized rows.
+ *
+ * Used when there is no bootstrapping and no missing values. Each gene row taking part
+ * in an edge is centered and scaled to unit norm once, so the correlation of an edge is
+ * the dot product of its two standardized rows. Edges are grouped by their source gene,
+ * and samples are processed in tiles, so a tile of the source row stays in cache while
+ * it is multiplied against all target rows, four targets at a time.
+ */
+#define STDCOR_TILE 512
+
+static inline void dot4_tile(const double * x, const double * y0, const double * y1,
+		const double * y2, const double * y3, int len, double * acc)
+{
+	double a0 = 0.0, a1 = 0.0, a2 = 0.0, a3 = 0.0;
+	#pragma omp simd reduction(+:a0,a1,a2,a3)
+	for (int i = 0; i < len; i++) {
+		a0 += x[i]*y0[i]; a1 += x[i]*y1[i]; a2 += x[i]*y2[i]; a3 += x[i]*y3[i];
+	}
+	acc[0] += a0; acc[1] += a1; acc[2] += a2; acc[3] += a3;
+}
+
+static inline double dot_tile(const double * x, const double * y, int len)
+{
+	double a = 0.0;
+	#pragma omp simd reduction(+:a)
+	for (int i = 0; i < len; i++) a += x[i]*y[i];
+	return a;
+}
 
+struct EdgeOrder {
+	const int * el; int nedges; const vector<int> &pos;
+	EdgeOrder(const int * el, int nedges, const vector<int> &pos): el(el), nedges(nedges), pos(pos) {}
+	bool operator()(int a, int b) const {
+		if (pos[el[a]] != pos[el[b]]) return pos[el[a]] < pos[el[b]];
+		return pos[el[a+nedges]] < pos[el[b+nedges]];
+	}
+};
+
+static void pearsonStd(const double * X, size_t ld, int nobs,
+    const int * EDGELIST, const int * SAMEGENE, double * WEIGHT, int nedges, int nthreads)
+{
+    // Compact index of the genes taking part in the (non same-gene) edges.
+    int maxgene = -1;
+    for (int indx = 0; indx < nedges; indx++) {
+        maxgene = max(maxgene, max(EDGELIST[indx], EDGELIST[indx+nedges]));
+    }
+    vector<int> gene_pos(maxgene + 1, -1);
+    vector<int> genes;
+    vector<int> edges; // edges to be computed
+    for (int indx = 0; indx < nedges; indx++) {
+        int from_indx = EDGELIST[indx], to_indx = EDGELIST[indx+nedges];
         if(to_indx == NA_INTEGER || from_indx == NA_INTEGER){
-        	WEIGHT[indx] = NA_REAL;
-        	continue;
+            WEIGHT[indx] = NA_REAL;
+            continue;
         }
+        if(SAMEGENE[indx] != 0){
+            WEIGHT[indx] = -1.0; // same gene penalty
+            continue;
+        }
+        WEIGHT[indx] = 0.0;
+        if(nobs <= 2) continue;
 
-        WEIGHT[indx] = 0.0; // if all else fails the weight will be assigned to -1 i.e. the most inprobable edge
+        if(gene_pos[from_indx] < 0){ gene_pos[from_indx] = genes.size(); genes.push_back(from_indx); }
+        if(gene_pos[to_indx] < 0){ gene_pos[to_indx] = genes.size(); genes.push_back(to_indx); }
+        edges.push_back(indx);
+    }
+    if(edges.empty()) return;
 
-        // Compute the correlation
-        if (SAMEGENE[indx] == 0) {
-        	double* corlist = new double[ncor];
+    // Standardize each gene row once. Rows are padded so each one starts on a cache line.
+    const size_t stride = ((size_t)nobs + 7) & ~(size_t)7;
+    const int ngenes = genes.size();
+    vector<double> Z(stride * ngenes, 0.0);
+    vector<char> constant(ngenes, 0);
 
-            for(int j=0; j<ncor; j++){
-				double Exy = 0.0, Exx = 0.0, Ex = 0.0, Eyy = 0.0, Ey = 0.0;
-				double xp = 0.0, yp = 0.0;
-				double n = (double)nobs;
+    #pragma omp parallel for schedule(static) num_threads(nthreads)
+    for (int g = 0; g < ngenes; g++) {
+        const double * x = X + (size_t)genes[g]*ld;
+        double * z = &Z[stride*g];
+        double mean = 0.0, ss = 0.0;
+        for (int i = 0; i < nobs; i++) mean += x[i];
+        mean /= nobs;
+        for (int i = 0; i < nobs; i++) { z[i] = x[i] - mean; ss += z[i]*z[i]; }
+        if (ss <= 0.0) { constant[g] = 1; continue; }
+        ss = 1.0 / sqrt(ss);
+        for (int i = 0; i < nobs; i++) z[i] *= ss;
+    }
 
-				for (i = 0;i < nobs;i = i + 1) {
-					if(ncor >1){  //If multiple correlations, sample the columns and take the median.
-						int sample = unif_rand() * nobs;
-						xp = X[from_indx*nobs + sample]; yp = X[to_indx*nobs + sample];
-					}else{
-					xp = X[from_indx*nobs + i]; yp = X[to_indx*nobs + i];
-					}
+    // Group edges by source gene (then target, for memory locality).
+    sort(edges.begin(), edges.end(), EdgeOrder(EDGELIST, nedges, gene_pos));
+    vector<int> runs;
+    for (size_t e = 0; e < edges.size(); e++) {
+        if (e == 0 || EDGELIST[edges[e]] != EDGELIST[edges[e-1]]) runs.push_back(e);
+    }
+    runs.push_back(edges.size());
+    const int nruns = runs.size() - 1;
 
-					if (!std::isnan(xp) && !std::isnan(yp)) {
-						Ex = Ex + xp; Exx = Exx + xp*xp; Ey = Ey + yp; Eyy = Eyy + yp*yp; Exy = Exy + xp*yp;
-					} else n = n - 1.0; // If it is a missing value skip that observation completely and reduce the dataset size by 1.
-				}
-				if (n > 2) {
-					if (Exy != 0.0 && Exx != 0.0 && Eyy != 0.0 && Ex != 0.0 && Ey != 0.0)
-						corlist[j] = (n*Exy - Ex*Ey)/ sqrt( (n*Exx - Ex*Ex) * (n*Eyy - Ey*Ey) );
-				}
+    #pragma omp parallel num_threads(nthreads)
+    {
+        vector<double> acc;
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int r = 0; r < nruns; r++) {
+            const int first = runs[r], len = runs[r+1] - runs[r];
+            const double * x = &Z[stride * gene_pos[EDGELIST[edges[first]]]];
+            acc.assign(len, 0.0);
+
+            for (int s = 0; s < nobs; s += STDCOR_TILE) {
+                const int tile = min(STDCOR_TILE, nobs - s);
+                int t = 0;
+                for (; t + 4 <= len; t += 4) {
+                    const double * y0 = &Z[stride * gene_pos[EDGELIST[edges[first+t]+nedges]] + s];
+                    const double * y1 = &Z[stride * gene_pos[EDGELIST[edges[first+t+1]+nedges]] + s];
+                    const double * y2 = &Z[stride * gene_pos[EDGELIST[edges[first+t+2]+nedges]] + s];
+                    const double * y3 = &Z[stride * gene_pos[EDGELIST[edges[first+t+3]+nedges]] + s];
+                    dot4_tile(x + s, y0, y1, y2, y3, tile, &acc[t]);
+                }
+                for (; t < len; t++) {
+                    acc[t] += dot_tile(x + s, &Z[stride * gene_pos[EDGELIST[edges[first+t]+nedges]] + s], tile);
+                }
+            }
+
+            for (int t = 0; t < len; t++) {
+                int indx = edges[first+t];
+                if (constant[gene_pos[EDGELIST[indx]]] || constant[gene_pos[EDGELIST[indx+nedges]]])
+                    continue; // correlation is undefined, keep the default weight.
+                WEIGHT[indx] = acc[t];
             }
-            WEIGHT[indx] = median(corlist, ncor);
-            delete[] corlist;
-        } else {
-            // If it is the same gene set to minimum of -1.0 (penalty)
-            WEIGHT[indx] = -1.0;
         }
     }
 }
 
+// Uses the standardized kernel when there is no bootstrapping and no missing values.
+static void pearsonEdgeWeights(const double * X, size_t ld, int nobs,
+    const int * EDGELIST, const int * SAMEGENE, double * WEIGHT, int nedges,
+    int ncor, uint64_t seed, int nthreads)
+{
+    const EdgeGenes eg(EDGELIST, SAMEGENE, nedges);
+    const vector<char> complete = complete_rows(X, ld, nobs, eg.genes, nthreads);
+
+    if (ncor <= 1 && all_complete(complete))
+        pearsonStd(X, ld, nobs, EDGELIST, SAMEGENE, WEIGHT, nedges, nthreads);
+    else
+        pearsonBoot(X, ld, nobs, EDGELIST, SAMEGENE, WEIGHT, nedges, eg, complete, ncor, seed, nthreads);
+}
+
+/* Rank based and information theoretic edge weights.
+ *
+ * Spearman's rho, Kendall's tau-b and binned mutual information are computed by
+ * pairEdgeWeights, which evaluates a kernel on the samples observed in both genes of an
+ * edge, optionally on the NCOR bootstrap resamples shared by all edges. A resample is
+ * given to the kernel as sample multiplicities, so kernels never copy the resampled rows.
+ * Everything a kernel can compute from a single gene row (sort orders, bins) is computed
+ * once per gene and shared by all of its edges.
+ */
+enum EdgeMethod { METHOD_PEARSON, METHOD_SPEARMAN, METHOD_KENDALL, METHOD_MI };
+
+// Order of the observed samples of each gene, by increasing value.
+struct ValueOrder {
+	const double *x; ValueOrder(const double *x): x(x) {}
+	bool operator()(int a, int b) const { return x[a] < x[b]; }
+};
+
+static void observed_order(const double * x, int nobs, vector<int> &order)
+{
+	order.clear();
+	for (int i = 0; i < nobs; i++) if (!std::isnan(x[i])) order.push_back(i);
+	sort(order.begin(), order.end(), ValueOrder(x));
+}
+
+/* Mid-ranks of the samples of x, each taken w[i] times (samples with w[i] == 0 are left
+ * out). order lists the observed samples by increasing value.
+ */
+static void weighted_ranks(const double * x, const int * order, int len, const double * w, double * rank)
+{
+	double cum = 0.0;
+	for (int a = 0; a < len; ) {
+		int b = a;
+		double tied = 0.0;
+		for (; b < len && x[order[b]] == x[order[a]]; b++) tied += w[order[b]];
+		const double rk = cum + (tied + 1.0)/2.0;
+		for (int k = a; k < b; k++) rank[order[k]] = rk;
+		cum += tied;
+		a = b;
+	}
+}
+
+// Spearman's rho: Pearson correlation of the (resampled) mid-ranks.
+class SpearmanKernel {
+	int nobs;
+	vector< vector<int> > orders;
+public:
+	struct Work {
+		vector<double> rx, ry;
+		Work(int nobs): rx(nobs, 0.0), ry(nobs, 0.0) {}
+	};
+
+	SpearmanKernel(const double * X, size_t ld, int nobs, const vector<int> &genes, int nthreads)
+		: nobs(nobs), orders(genes.size()) {
+		#pragma omp parallel for schedule(static) num_threads(nthreads)
+		for (int g = 0; g < (int)genes.size(); g++)
+			observed_order(X + (size_t)genes[g]*ld, nobs, orders[g]);
+	}
+
+	double operator()(Work &work, int gx, int gy, const double * x, const double * y, const double * w) const {
+		weighted_ranks(x, &orders[gx][0], orders[gx].size(), w, &work.rx[0]);
+		weighted_ranks(y, &orders[gy][0], orders[gy].size(), w, &work.ry[0]);
+		double n = 0.0, Ex = 0.0, Ey = 0.0, Exx = 0.0, Eyy = 0.0, Exy = 0.0;
+		for (int i = 0; i < nobs; i++) {
+			if (w[i] == 0.0) continue;
+			const double rx = work.rx[i], ry = work.ry[i];
+			n += w[i]; Ex += w[i]*rx; Ey += w[i]*ry;
+			Exx += w[i]*rx*rx; Eyy += w[i]*ry*ry; Exy += w[i]*rx*ry;
+		}
+		return cor_from_sums(n, Ex, Ey, Exx, Eyy, Exy);
+	}
+};
+
+// Number of pairs i < j with y[i] > y[j], counted while merge sorting y.
+static double merge_count(double * y, double * tmp, int n)
+{
+	if (n < 2) return 0.0;
+	const int h = n/2;
+	double swaps = merge_count(y, tmp, h) + merge_count(y + h, tmp, n - h);
+	int a = 0, b = h, k = 0;
+	while (a < h && b < n) {
+		if (y[b] < y[a]) { tmp[k++] = y[b++]; swaps += h - a; }
+		else tmp[k++] = y[a++];
+	}
+	while (a < h) tmp[k++] = y[a++];
+	while (b < n) tmp[k++] = y[b++];
+	copy(tmp, tmp + n, y);
+	return swaps;
+}
+
+// Sum of t(t-1)/2 over the runs of equal consecutive values.
+template <class It, class Eq>
+static double tied_pairs(It first, It last, Eq eq)
+{
+	double ties = 0.0, t = 1.0;
+	for (It it = first; it != last; ++it) {
+		if (it + 1 != last && eq(*it, *(it + 1))) { t += 1.0; continue; }
+		ties += t*(t - 1.0)/2.0;
+		t = 1.0;
+	}
+	return ties;
+}
+
+struct FirstEq { bool operator()(const pair<double,double> &a, const pair<double,double> &b) const { return a.first == b.first; } };
+struct PairEq { bool operator()(const pair<double,double> &a, const pair<double,double> &b) const { return a == b; } };
+struct ValueEq { bool operator()(double a, double b) const { return a == b; } };
+
+// Kendall's tau-b, using Knight's O(n log n) algorithm.
+class KendallKernel {
+public:
+	struct Work {
+		vector< pair<double,double> > xy;
+		vector<double> y, tmp;
+		int nobs;
+		Work(int nobs): nobs(nobs) { xy.reserve(nobs); y.reserve(nobs); tmp.resize(nobs); }
+	};
+
+	KendallKernel(const double *, size_t, int, const vector<int> &, int) {}
+
+	double operator()(Work &work, int, int, const double * x, const double * y, const double * w) const {
+		// Resampled pairs, sorted by x then y.
+		work.xy.clear();
+		for (int i = 0; i < work.nobs; i++)
+			for (int k = 0; k < (int)w[i]; k++) work.xy.push_back(make_pair(x[i], y[i]));
+		const int n = work.xy.size();
+		if (n <= 2) return NA_REAL;
+		sort(work.xy.begin(), work.xy.end());
+
+		const double npairs = (double)n*(n - 1)/2.0;
+		const double xties = tied_pairs(work.xy.begin(), work.xy.end(), FirstEq());
+		const double jointties = tied_pairs(work.xy.begin(), work.xy.end(), PairEq());
+
+		// Pairs out of order in y are the discordant pairs.
+		work.y.resize(n);
+		for (int i = 0; i < n; i++) work.y[i] = work.xy[i].second;
+		const double discordant = merge_count(&work.y[0], &work.tmp[0], n);
+		const double yties = tied_pairs(work.y.begin(), work.y.end(), ValueEq());
+
+		const double den = (npairs - xties)*(npairs - yties);
+		if (den <= 0.0) return NA_REAL;
+		return (npairs - xties - yties + jointties - 2.0*discordant) / sqrt(den);
+	}
+};
+
+/* Mutual information (in nats) of the genes' expression, discretized once per gene into
+ * floor(sqrt(nobs)) (at least 2) equal width bins spanning its observed range.
+ */
+class MIKernel {
+	int nobs, nbins;
+	vector<int> bins;
+public:
+	struct Work {
+		vector<double> joint, px, py;
+		Work(int) {}
+	};
+
+	MIKernel(const double * X, size_t ld, int nobs, const vector<int> &genes, int nthreads)
+		: nobs(nobs), nbins(max(2, (int)sqrt((double)nobs))), bins(genes.size()*(size_t)nobs, -1) {
+		#pragma omp parallel for schedule(static) num_threads(nthreads)
+		for (int g = 0; g < (int)genes.size(); g++) {
+			const double * x = X + (size_t)genes[g]*ld;
+			double lo = R_PosInf, hi = R_NegInf;
+			for (int i = 0; i < nobs; i++) {
+				if (std::isnan(x[i])) continue;
+				lo = min(lo, x[i]); hi = max(hi, x[i]);
+			}
+			const double width = (hi - lo)/nbins;
+			for (int i = 0; i < nobs; i++) {
+				if (std::isnan(x[i])) continue;
+				bins[(size_t)g*nobs + i] = width > 0.0 ? min(nbins - 1, (int)((x[i] - lo)/width)) : 0;
+			}
+		}
+	}
+
+	double operator()(Work &work, int gx, int gy, const double *, const double *, const double * w) const {
+		const int * bx = &bins[(size_t)gx*nobs], * by = &bins[(size_t)gy*nobs];
+		work.joint.assign(nbins*nbins, 0.0);
+		work.px.assign(nbins, 0.0);
+		work.py.assign(nbins, 0.0);
+		double n = 0.0;
+		for (int i = 0; i < nobs; i++) {
+			if (w[i] == 0.0) continue;
+			work.joint[bx[i]*nbins + by[i]] += w[i];
+			work.px[bx[i]] += w[i]; work.py[by[i]] += w[i];
+			n += w[i];
+		}
+		if (n <= 2) return NA_REAL;
+
+		double mi = 0.0;
+		for (int a = 0; a < nbins; a++) {
+			for (int b = 0; b < nbins; b++) {
+				const double nab = work.joint[a*nbins + b];
+				if (nab > 0.0) mi += nab * log(nab * n / (work.px[a] * work.py[b]));
+			}
+		}
+		return mi / n;
+	}
+};
+
+/* Edge weights of a pairwise kernel, with the same conventions as pearsonBoot: NA edges
+ * are NA, same-gene edges are -1, and edges whose weight is undefined are 0.
+ */
+template <class Kernel>
+static void pairEdgeWeights(const double * X, size_t ld, int nobs,
+    const int * EDGELIST, const int * SAMEGENE, double * WEIGHT, int nedges,
+    int ncor, uint64_t seed, int nthreads)
+{
+    ncor = max(ncor, 1);
+    const bool bootstrap = ncor > 1;
+    const Bootstrap boot(bootstrap ? ncor : 0, nobs, seed);
+    const EdgeGenes eg(EDGELIST, SAMEGENE, nedges);
+    const vector<int> &gene_pos = eg.gene_pos, &genes = eg.genes;
+
+    const Kernel kernel(X, ld, nobs, genes, nthreads);
+
+    #pragma omp parallel num_threads(nthreads)
+    {
+        typename Kernel::Work work(nobs);
+        vector<double> corlist(ncor), mask(nobs), w(nobs);
+
+        #pragma omp for schedule(dynamic, 64)
+        for (int indx = 0; indx < nedges; indx++) {
+            int to_indx = EDGELIST[indx+nedges];
+            int from_indx = EDGELIST[indx];
+
+            if(to_indx == NA_INTEGER || from_indx == NA_INTEGER){
+                WEIGHT[indx] = NA_REAL;
+                continue;
+            }
+            WEIGHT[indx] = 0.0;
+            if (SAMEGENE[indx] != 0) {
+                WEIGHT[indx] = -1.0;
+                continue;
+            }
+
+            const double * x = X + (size_t)from_indx*ld;
+            const double * y = X + (size_t)to_indx*ld;
+            const int gx = gene_pos[from_indx], gy = gene_pos[to_indx];
+
+            // Samples observed in both genes.
+            for (int i = 0; i < nobs; i++)
+                mask[i] = !std::isnan(x[i]) && !std::isnan(y[i]);
+
+            for (int r = 0; r < ncor; r++) {
+                const double * cnt = bootstrap ? boot.rep(r) : &mask[0];
+                for (int i = 0; i < nobs; i++) w[i] = cnt[i]*mask[i];
+                corlist[r] = kernel(work, gx, gy, x, y, &w[0]);
+            }
+
+            double med = median(&corlist[0], ncor);
+            if (!std::isnan(med)) WEIGHT[indx] = med;
+        }
+    }
+}
+
+/* Spearman's rho without bootstrapping or missing values: the rows are ranked once, and
+ * the standardized Pearson kernel is run on the ranks.
+ */
+static void spearmanEdgeWeights(const double * X, size_t ld, int nobs,
+    const int * EDGELIST, const int * SAMEGENE, double * WEIGHT, int nedges,
+    int ncor, uint64_t seed, int nthreads)
+{
+    const EdgeGenes eg(EDGELIST, SAMEGENE, nedges);
+    if (ncor > 1 || !all_complete(complete_rows(X, ld, nobs, eg.genes, nthreads))) {
+        pairEdgeWeights<SpearmanKernel>(X, ld, nobs, EDGELIST, SAMEGENE, WEIGHT, nedges, ncor, seed, nthreads);
+        return;
+    }
+
+    // Edges in terms of ranked rows. Same-gene edges are not computed, so any row will do.
+    const vector<int> &genes = eg.genes;
+    vector<int> rel(2*nedges);
+    for (int indx = 0; indx < 2*nedges; indx++) {
+        const int g = EDGELIST[indx];
+        if (g == NA_INTEGER) rel[indx] = NA_INTEGER;
+        else rel[indx] = SAMEGENE[indx % nedges] != 0 ? 0 : eg.gene_pos[g];
+    }
+
+    const int ngenes = genes.size();
+    vector<double> R((size_t)ngenes*nobs), ones(nobs, 1.0);
+    #pragma omp parallel num_threads(nthreads)
+    {
+        vector<int> order;
+        #pragma omp for schedule(static)
+        for (int g = 0; g < ngenes; g++) {
+            const double * x = X + (size_t)genes[g]*ld;
+            observed_order(x, nobs, order);
+            weighted_ranks(x, &order[0], nobs, &ones[0], &R[(size_t)g*nobs]);
+        }
+    }
+
+    pearsonStd(R.empty() ? NULL : &R[0], nobs, nobs, &rel[0], SAMEGENE, WEIGHT, nedges, nthreads);
+}
+
+static EdgeMethod edge_method(SEXP METHOD)
+{
+	const char * name = CHAR(STRING_ELT(METHOD, 0));
+	if (!strcmp(name, "pearson")) return METHOD_PEARSON;
+	if (!strcmp(name, "spearman")) return METHOD_SPEARMAN;
+	if (!strcmp(name, "kendall")) return METHOD_KENDALL;
+	if (!strcmp(name, "mi")) return METHOD_MI;
+	Rf_error("Unknown edge weight method: %s", name);
+	return METHOD_PEARSON;
+}
+
+static void edgeWeights(EdgeMethod method, const double * X, size_t ld, int nobs,
+    const int * EDGELIST, const int * SAMEGENE, double * WEIGHT, int nedges,
+    int ncor, uint64_t seed, int nthreads)
+{
+    switch (method) {
+    case METHOD_SPEARMAN:
+        spearmanEdgeWeights(X, ld, nobs, EDGELIST, SAMEGENE, WEIGHT, nedges, ncor, seed, nthreads);
+        break;
+    case METHOD_KENDALL:
+        pairEdgeWeights<KendallKernel>(X, ld, nobs, EDGELIST, SAMEGENE, WEIGHT, nedges, ncor, seed, nthreads);
+        break;
+    case METHOD_MI:
+        pairEdgeWeights<MIKernel>(X, ld, nobs, EDGELIST, SAMEGENE, WEIGHT, nedges, ncor, seed, nthreads);
+        break;
+    default:
+        pearsonEdgeWeights(X, ld, nobs, EDGELIST, SAMEGENE, WEIGHT, nedges, ncor, seed, nthreads);
+    }
+}
+
+// Weights of the edges selected by SUBSET (all edges if NULL); the others are NA. Bootstrap
+// resamples do not depend on the edges, so a selected edge gets the weight it gets among all.
+static void subsetEdgeWeights(EdgeMethod method, const double * X, size_t ld, int nobs,
+    const int * EDGELIST, const int * SAMEGENE, const int * SUBSET, double * WEIGHT, int nedges,
+    int ncor, uint64_t seed, int nthreads)
+{
+    if (SUBSET == NULL) {
+        edgeWeights(method, X, ld, nobs, EDGELIST, SAMEGENE, WEIGHT, nedges, ncor, seed, nthreads);
+        return;
+    }
+
+    vector<int> idx;
+    for (int e = 0; e < nedges; e++) {
+        if (SUBSET[e]) idx.push_back(e);
+        else WEIGHT[e] = NA_REAL;
+    }
+    const int nsub = idx.size();
+    if (nsub == 0) return;
+
+    vector<int> el(2*nsub), sameg(nsub);
+    vector<double> weight(nsub);
+    for (int i = 0; i < nsub; i++) {
+        el[i] = EDGELIST[idx[i]];
+        el[i+nsub] = EDGELIST[idx[i]+nedges];
+        sameg[i] = SAMEGENE[idx[i]];
+    }
+    edgeWeights(method, X, ld, nobs, &el[0], &sameg[0], &weight[0], nsub, ncor, seed, nthreads);
+    for (int i = 0; i < nsub; i++) WEIGHT[idx[i]] = weight[i];
+}
+
+/* Edge weights for all sample labels at once.
+ *
+ * X is the (genes x samples) expression matrix as given by R, or a memory-mapped matrix
+ * (see exprmatrix.h). LABELS assigns each sample (column) a label in 1..NLABELS, or NA to
+ * leave it out. The rows of the genes taking part in the edges are gathered into one
+ * row-major block per label in a single pass over the matrix, and each block is weighted
+ * with the kernel of METHOD ("pearson", "spearman", "kendall" or "mi"). A float64 mapped
+ * matrix whose samples all have the same label is weighted in place, without any copy.
+ * SUBSET is NULL, or an (edges x labels) logical matrix selecting the weights to compute;
+ * those not selected are NA. Each label draws from its own random stream, so a weight does
+ * not depend on which others are computed. Returns an (edges x labels) weight matrix.
+ */
+SEXP labelEdgeWeights(SEXP X, SEXP EL, SEXP SAMEG, SEXP LABELS, SEXP NLABELS, SEXP NCOR, SEXP METHOD,
+	SEXP SUBSET, SEXP NTHREADS)
+{
+	const EdgeMethod method = edge_method(METHOD);
+	const npm_matrix *mapped = npm_matrix_get(X);
+	if(mapped == NULL && !Rf_isReal(X))
+		X = Rf_coerceVector(X, REALSXP);
+	PROTECT(X);
+
+	const int nrow = mapped ? mapped->nrow : Rf_nrows(X), ncol = mapped ? mapped->ncol : Rf_ncols(X);
+	const int nedges = LENGTH(SAMEG);
+	const int nlabels = Rf_asInteger(NLABELS);
+	const int ncor = Rf_asInteger(NCOR) == NA_INTEGER ? 1 : Rf_asInteger(NCOR);
+	const int nthreads = npm_threads(Rf_asInteger(NTHREADS));
+	const int *el = INTEGER(EL), *labels = INTEGER(LABELS);
+	const int *subset = Rf_isNull(SUBSET) ? NULL : LOGICAL(SUBSET);
+
+	if(LENGTH(EL) != 2*nedges)
+		Rf_error("Edge list and same gene flags have different lengths.");
+	if(LENGTH(LABELS) != ncol)
+		Rf_error("Number of labels doesn't match samples in the microarray.");
+	if(subset != NULL && XLENGTH(SUBSET) != (R_xlen_t)nedges*nlabels)
+		Rf_error("Edge subset doesn't match edges and labels.");
+
+	// Edges selected in any label.
+	vector<char> used(nedges, subset == NULL);
+	if(subset != NULL){
+		for(size_t i=0; i<(size_t)nedges*nlabels; i++)
+			if(subset[i]) used[i % nedges] = 1;
+	}
+
+	// Genes taking part in the edges, and the edge list in terms of gathered rows.
+	vector<int> gene_pos(nrow, -1), genes, cel(2*nedges);
+	for(int i=0; i<2*nedges; i++){
+		if(el[i] == NA_INTEGER || !used[i % nedges]){ cel[i] = NA_INTEGER; continue; }
+		if(el[i] < 0 || el[i] >= nrow)
+			Rf_error("Edge list refers to a gene outside the microarray.");
+		if(gene_pos[el[i]] < 0){ gene_pos[el[i]] = genes.size(); genes.push_back(el[i]); }
+		cel[i] = gene_pos[el[i]];
+	}
+	const int ngenes = genes.size();
+
+	// Position of each sample within its label.
+	vector<int> nsamples(nlabels, 0), col_pos(ncol, -1);
+	for(int j=0; j<ncol; j++){
+		if(labels[j] == NA_INTEGER) continue;
+		if(labels[j] < 1 || labels[j] > nlabels)
+			Rf_error("Invalid sample label.");
+		col_pos[j] = nsamples[labels[j]-1]++;
+	}
+
+	const uint64_t seed = ncor > 1 ? npm_seed_from_R() : 0;
+
+	SEXP WEIGHTS;
+	PROTECT(WEIGHTS = Rf_allocMatrix(REALSXP, nedges, nlabels));
+
+	if(mapped != NULL && mapped->dtype == NPM_MATRIX_FLOAT64 && nlabels == 1 && nsamples[0] == ncol){
+		// The rows are read directly from the mapping.
+		npm_rng rng;
+		npm_rng_seed(&rng, seed, 0);
+		subsetEdgeWeights(method, (const double *)mapped->data, ncol, ncol, el, INTEGER(SAMEG), subset,
+			REAL(WEIGHTS), nedges, ncor, npm_rng_next(&rng), nthreads);
+		UNPROTECT(2);
+		return(WEIGHTS);
+	}
+
+	vector< vector<double> > blocks(nlabels);
+	for(int l=0; l<nlabels; l++)
+		blocks[l].resize((size_t)ngenes * nsamples[l]);
+
+	if(mapped != NULL){
+		// Gather the rows of all labels in one pass over the (row-major) mapped rows.
+		#pragma omp parallel num_threads(nthreads)
+		{
+			vector<double> buf(ncol);
+			#pragma omp for schedule(static)
+			for(int g=0; g<ngenes; g++){
+				const double *row = npm_matrix_row(mapped, genes[g], buf.empty() ? NULL : &buf[0]);
+				for(int j=0; j<ncol; j++){
+					if(col_pos[j] < 0) continue;
+					const int l = labels[j]-1;
+					blocks[l][(size_t)g*nsamples[l] + col_pos[j]] = row[j];
+				}
+			}
+		}
+	}else{
+		// Gather the rows of all labels in one pass over the columns.
+		const double *x = REAL(X);
+		#pragma omp parallel for schedule(static) num_threads(nthreads)
+		for(int j=0; j<ncol; j++){
+			if(col_pos[j] < 0) continue;
+			const int l = labels[j]-1, nl = nsamples[l];
+			const double *col = x + (size_t)j*nrow;
+			double *block = blocks[l].empty() ? NULL : &blocks[l][col_pos[j]];
+			for(int g=0; g<ngenes; g++)
+				block[(size_t)g*nl] = col[genes[g]];
+		}
+	}
+
+	for(int l=0; l<nlabels; l++){
+		npm_rng rng;
+		npm_rng_seed(&rng, seed, (uint64_t)l);
+		const double *block = blocks[l].empty() ? NULL : &blocks[l][0];
+
+		subsetEdgeWeights(method, block, nsamples[l], nsamples[l], &cel[0], INTEGER(SAMEG),
+			subset ? subset + (size_t)l*nedges : NULL,
+			REAL(WEIGHTS) + (size_t)l*nedges, nedges, ncor, npm_rng_next(&rng), nthreads);
+		vector<double>().swap(blocks[l]);
+	}
+
+	UNPROTECT(2);
+	return(WEIGHTS);
+}
+
+/* Aggregation of gene connection weights into edge weights.
+ *
+ * A method is either a constant (numeric or NA) or one of the reducers max, min, mean and
+ * median, which ignore missing values and, over an empty set, return what R's functions
+ * return.
+ */
+enum WeightReducer { REDUCE_CONST, REDUCE_MAX, REDUCE_MIN, REDUCE_MEAN, REDUCE_MEDIAN };
+
+struct WeightMethod {
+	WeightReducer type;
+	double value;
+};
+
+static WeightMethod weight_method(SEXP METHOD){
+	WeightMethod m;
+	m.type = REDUCE_CONST;
+	m.value = NA_REAL;
+
+	if(TYPEOF(METHOD) == STRSXP){
+		string name = CHAR(STRING_ELT(METHOD,0));
+		if(name == "max") m.type = REDUCE_MAX;
+		else if(name == "min") m.type = REDUCE_MIN;
+		else if(name == "mean") m.type = REDUCE_MEAN;
+		else if(name == "median") m.type = REDUCE_MEDIAN;
+		else Rf_error("Unknown aggregation method: %s", name.c_str());
+	}else if(LENGTH(METHOD) > 0){
+		m.value = Rf_asReal(METHOD);
+	}
+	return m;
+}
+
+// Reduces n values of x, which may be reordered.
+static double reduce_weights(const WeightMethod &m, double * x, int n){
+	if(m.type == REDUCE_CONST) return m.value;
+	if(m.type == REDUCE_MEDIAN) return median(x, n);
+
+	int k = 0;
+	double acc = m.type == REDUCE_MAX ? R_NegInf : (m.type == REDUCE_MIN ? R_PosInf : 0.0);
+	for(int i=0; i<n; i++){
+		if(std::isnan(x[i])) continue;
+		k++;
+		if(m.type == REDUCE_MAX) acc = max(acc, x[i]);
+		else if(m.type == REDUCE_MIN) acc = min(acc, x[i]);
+		else acc += x[i];
+	}
+	if(m.type == REDUCE_MEAN) return k > 0 ? acc/k : R_NaN;
+	return acc;
+}
+
+/* Edge weights from gene connection weights, for each label (column) of W.
+ *
+ * ID gives the (1-based) edge of each gene connection. Same-gene connections (SAMEG) are set
+ * to the SAMEGENE penalty, and edges without any connection to the MISSING value, both
+ * computed from the remaining connection weights of the label. The connections of each edge
+ * are then reduced by the COMPLEX method. Returns an (edges x labels) matrix.
+ */
+SEXP aggregateEdgeWeights(SEXP W, SEXP ID, SEXP SAMEG, SEXP NEDGES,
+		SEXP COMPLEX, SEXP MISSING, SEXP SAMEGENE, SEXP NTHREADS)
+{
+	if(!Rf_isReal(W))
+		W = Rf_coerceVector(W, REALSXP);
+	PROTECT(W);
+
+	const int nconn = Rf_nrows(W), nlabels = Rf_ncols(W);
+	const int nedges = Rf_asInteger(NEDGES);
+	const int nthreads = npm_threads(Rf_asInteger(NTHREADS));
+	const int *id = INTEGER(ID), *sameg = INTEGER(SAMEG);
+	const WeightMethod complex = weight_method(COMPLEX);
+	const WeightMethod missing = weight_method(MISSING);
+	const WeightMethod samegene = weight_method(SAMEGENE);
+
+	if(LENGTH(ID) != nconn || LENGTH(SAMEG) != nconn)
+		Rf_error("Connection ids and same gene flags must match the weights.");
+
+	// Group connections by edge (counting sort).
+	vector<int> offset(nedges + 1, 0), conn(nconn);
+	for(int i=0; i<nconn; i++){
+		if(id[i] == NA_INTEGER || id[i] < 1 || id[i] > nedges)
+			Rf_error("Invalid edge id.");
+		offset[id[i]]++;
+	}
+	for(int e=0; e<nedges; e++) offset[e+1] += offset[e];
+	{
+		vector<int> next(offset.begin(), offset.end() - 1);
+		for(int i=0; i<nconn; i++) conn[next[id[i]-1]++] = i;
+	}
+
+	SEXP OUT;
+	PROTECT(OUT = Rf_allocMatrix(REALSXP, nedges, nlabels));
+
+	for(int l=0; l<nlabels; l++){
+		const double *w = REAL(W) + (size_t)l*nconn;
+		double *out = REAL(OUT) + (size_t)l*nedges;
+
+		// Same gene penalty and missing value from the other weights of this label.
+		vector<double> vals;
+		for(int i=0; i<nconn; i++)
+			if(!sameg[i] && !std::isnan(w[i])) vals.push_back(w[i]);
+		vector<double> buf(vals);
+		const double sg_val = reduce_weights(samegene, buf.empty() ? NULL : &buf[0], buf.size());
+		buf = vals;
+		const double ms_val = reduce_weights(missing, buf.empty() ? NULL : &buf[0], buf.size());
+
+		#pragma omp parallel num_threads(nthreads)
+		{
+			vector<double> group;
+
+			#pragma omp for schedule(dynamic, 256)
+			for(int e=0; e<nedges; e++){
+				group.clear();
+				for(int k=offset[e]; k<offset[e+1]; k++)
+					group.push_back(sameg[conn[k]] ? sg_val : w[conn[k]]);
+				if(group.empty())
+					group.push_back(ms_val);
+				out[e] = reduce_weights(complex, &group[0], group.size());
+			}
+		}
+	}
+
+	UNPROTECT(2);
+	return(OUT);
+}
+
+/* Open addressing hash index of strings (FNV-1a), mapping each distinct string to the
+ * position of its first occurrence, as match() does.
+ */
+class StringIndex {
+	vector<const char*> keys;
+	vector<int> values;
+	size_t mask;
+
+	static size_t hash(const char *s){
+		size_t h = 2166136261u;
+		for(; *s; s++){ h ^= (unsigned char)(*s); h *= 16777619u; }
+		return h;
+	}
+public:
+	StringIndex(SEXP STR){
+		size_t size = 16;
+		while(size < 2*(size_t)LENGTH(STR)) size <<= 1;
+		keys.assign(size, (const char*)NULL);
+		values.assign(size, -1);
+		mask = size - 1;
+		for(int i=0; i<LENGTH(STR); i++){
+			if(STRING_ELT(STR,i) == NA_STRING) continue;
+			const char *key = CHAR(STRING_ELT(STR,i));
+			size_t pos = hash(key) & mask;
+			while(keys[pos] != NULL && strcmp(keys[pos], key) != 0) pos = (pos + 1) & mask;
+			if(keys[pos] == NULL){ keys[pos] = key; values[pos] = i; }
+		}
+	}
+	// Position of key, or -1 if it is not indexed.
+	int find(const char *key) const {
+		size_t pos = hash(key) & mask;
+		while(keys[pos] != NULL){
+			if(strcmp(keys[pos], key) == 0) return values[pos];
+			pos = (pos + 1) & mask;
+		}
+		return -1;
+	}
+};
+
+/* Gene connections of a network.
+ *
+ * For each edge of EL (0-based, from vertices followed by to vertices), every pair of genes
+ * annotated to its vertices (GENES, a list of character vectors) is matched against the
+ * microarray ROWNAMES. Pairs where both genes are found are returned, in the order of
+ * expand.grid, as 1-based from/to rows and edge ids, with a flag for same-gene pairs.
+ */
+SEXP geneConnections(SEXP EL, SEXP GENES, SEXP ROWNAMES)
+{
+	const int nedges = LENGTH(EL)/2, nvertices = LENGTH(GENES);
+	const int *el = INTEGER(EL);
+	const StringIndex rows(ROWNAMES);
+
+	// Microarray rows of each vertex's genes (-1 if not found).
+	vector< vector<int> > vrows(nvertices);
+	for(int v=0; v<nvertices; v++){
+		SEXP G = VECTOR_ELT(GENES, v);
+		if(Rf_isNull(G)) continue;
+		G = PROTECT(AS_CHARACTER(G));
+		for(int j=0; j<LENGTH(G); j++)
+			vrows[v].push_back(STRING_ELT(G,j) == NA_STRING ? -1 : rows.find(CHAR(STRING_ELT(G,j))));
+		UNPROTECT(1);
+	}
+
+	vector<int> from, to, id;
+	for(int e=0; e<nedges; e++){
+		const int v1 = el[e], v2 = el[e+nedges];
+		if(v1 < 0 || v1 >= nvertices || v2 < 0 || v2 >= nvertices)
+			Rf_error("Edge list refers to an invalid vertex.");
+		for(size_t j=0; j<vrows[v2].size(); j++){
+			if(vrows[v2][j] < 0) continue;
+			for(size_t i=0; i<vrows[v1].size(); i++){
+				if(vrows[v1][i] < 0) continue;
+				from.push_back(vrows[v1][i]);
+				to.push_back(vrows[v2][j]);
+				id.push_back(e);
+			}
+		}
+	}
+
+	SEXP OUT, NAMES, FROM, TO, ID, SAMEG;
+	PROTECT( FROM = NEW_INTEGER(from.size()) );
+	PROTECT( TO = NEW_INTEGER(to.size()) );
+	PROTECT( ID = NEW_INTEGER(id.size()) );
+	PROTECT( SAMEG = NEW_LOGICAL(id.size()) );
+	for(size_t i=0; i<id.size(); i++){
+		INTEGER(FROM)[i] = from[i]+1;
+		INTEGER(TO)[i] = to[i]+1;
+		INTEGER(ID)[i] = id[i]+1;
+		LOGICAL(SAMEG)[i] = from[i] == to[i];
+	}
+
+	PROTECT( OUT = NEW_LIST(4));
+	PROTECT( NAMES = NEW_STRING(4));
+	SET_VECTOR_ELT(OUT, 0, FROM);	SET_STRING_ELT(NAMES, 0, Rf_mkChar("from"));
+	SET_VECTOR_ELT(OUT, 1, TO);	SET_STRING_ELT(NAMES, 1, Rf_mkChar("to"));
+	SET_VECTOR_ELT(OUT, 2, ID);	SET_STRING_ELT(NAMES, 2, Rf_mkChar("id"));
+	SET_VECTOR_ELT(OUT, 3, SAMEG);	SET_STRING_ELT(NAMES, 3, Rf_mkChar("samegene"));
+
+	Rf_setAttrib(OUT,R_NamesSymbol,NAMES);
+	UNPROTECT(6);
+	return(OUT);
+}
+
 SEXP expand_complexes(SEXP ATTR_LS, SEXP EL, SEXP V, SEXP EXPAND, SEXP MISSING){
 	/* Processing arguments */
 	vector<vector<string> > attr_ls;
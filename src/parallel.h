@@ -0,0 +1,78 @@
+#ifndef __parallel__h_
+#define __parallel__h_
+
+#include <stdint.h>
+#include "init.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* Number of threads to use for a requested thread count.
+ * Non-positive values request all available processors. Without OpenMP
+ * everything runs on the calling thread.
+ */
+static inline int npm_threads(int requested){
+#ifdef _OPENMP
+	int nproc = omp_get_num_procs();
+	if(requested <= 0 || requested > nproc)
+		return nproc;
+	return requested;
+#else
+	(void)requested;
+	return 1;
+#endif
+}
+
+// Index of the calling thread within its team.
+static inline int npm_thread_num(void){
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+/* Random number streams for threaded code.
+ *
+ * unif_rand() is not thread safe, so a single seed is drawn from R's RNG in the
+ * master thread, and an independent splitmix64 stream is derived from it for each
+ * unit of work (an edge, a chain, a restart...). Random draws thus depend only on
+ * the seed and the unit index, never on the number of threads.
+ */
+typedef struct { uint64_t state; } npm_rng;
+
+static inline uint64_t npm_rng_next(npm_rng *rng){
+	uint64_t z = (rng->state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static inline void npm_rng_seed(npm_rng *rng, uint64_t seed, uint64_t stream){
+	rng->state = seed;
+	rng->state ^= npm_rng_next(rng) + stream * 0xD1B54A32D192ED03ULL;
+	npm_rng_next(rng);
+}
+
+// Uniform double in [0, 1)
+static inline double npm_unif(npm_rng *rng){
+	return (double)(npm_rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Uniform integer in [0, n)
+static inline int npm_unif_index(npm_rng *rng, int n){
+	return (int)(npm_unif(rng) * n);
+}
+
+// Draws a 64-bit seed from R's RNG. Must be called from the master thread.
+static inline uint64_t npm_seed_from_R(void){
+	uint64_t seed;
+	GetRNGstate();
+	seed = (uint64_t)(unif_rand() * 4294967296.0) << 32;
+	seed |= (uint64_t)(unif_rand() * 4294967296.0);
+	PutRNGstate();
+	return seed;
+}
+
+#endif
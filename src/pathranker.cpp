@@ -0,0 +1,826 @@
+#include "init.h"
+#include "parallel.h"
+#include <map>
+#include <queue>
+#include <set>
+
+/* Directed graph in compressed sparse row form: the out-edges of vertex v are
+ * offset[v] .. offset[v+1]-1, each with its head vertex and its id in the edge list.
+ */
+struct CSRGraph {
+	int nv, ne;
+	vector<int> offset, head, eid;
+
+	// EL holds the (0-based) tail vertices of the NE edges followed by their heads.
+	CSRGraph(int nv, const int * el, int ne): nv(nv), ne(ne), offset(nv + 1, 0), head(ne), eid(ne) {
+		for(int e=0; e<ne; e++){
+			if(el[e] < 0 || el[e] >= nv || el[e+ne] < 0 || el[e+ne] >= nv)
+				Rf_error("Edge list refers to an invalid vertex.");
+			offset[el[e] + 1]++;
+		}
+		for(int v=0; v<nv; v++) offset[v+1] += offset[v];
+		vector<int> pos(offset.begin(), offset.end() - 1);
+		for(int e=0; e<ne; e++){
+			head[pos[el[e]]] = el[e+ne];
+			eid[pos[el[e]]++] = e;
+		}
+	}
+};
+
+struct Path {
+	double distance;
+	vector<int> vertices, edges;
+	int deviation;	// index of the vertex the path deviates from its parent at
+
+	// Paths are ordered by distance, ties broken by their edges.
+	bool operator<(const Path &p) const {
+		if(distance != p.distance) return distance < p.distance;
+		return edges < p.edges;
+	}
+};
+
+/* Yen's loopless k-shortest paths, with Lawler's rule of only deviating a path after the
+ * vertex it deviated from its parent at.
+ *
+ * Edge weights must be non-negative; edges with non-finite weights are ignored. Paths
+ * with fewer than minsize edges are not reported, and do not count toward K, but are still
+ * deviated from, since longer paths may branch off them. As a dense network may have a
+ * combinatorial number of short paths, the search gives up after max_short of them per
+ * requested path.
+ */
+class YenKSP {
+	const CSRGraph &g;
+	const double * w;
+
+	// Dijkstra workspace. Entries are valid when their stamp matches the current search.
+	vector<double> dist;
+	vector<int> pred, predv, seen, vban, eban;
+	int stamp;
+
+	typedef pair<double,int> QItem;
+
+	static const int max_short = 1000;	// paths shorter than minsize, per requested path
+
+	// Shortest path from src to dst avoiding banned vertices and edges (of the current stamp).
+	bool shortest(int src, int dst, Path &p) {
+		priority_queue<QItem, vector<QItem>, greater<QItem> > queue;
+		seen[src] = stamp; dist[src] = 0.0; pred[src] = -1; predv[src] = -1;
+		queue.push(QItem(0.0, src));
+		bool found = false;
+		while(!queue.empty()){
+			const QItem top = queue.top(); queue.pop();
+			const int v = top.second;
+			if(top.first > dist[v]) continue;
+			if(v == dst){ found = true; break; }
+			for(int k=g.offset[v]; k<g.offset[v+1]; k++){
+				const int u = g.head[k], e = g.eid[k];
+				if(vban[u] == stamp || eban[e] == stamp || !R_FINITE(w[e])) continue;
+				const double d = dist[v] + w[e];
+				if(seen[u] != stamp || d < dist[u]){
+					seen[u] = stamp; dist[u] = d; pred[u] = g.eid[k]; predv[u] = v;
+					queue.push(QItem(d, u));
+				}
+			}
+		}
+		if(!found) return false;
+
+		p.vertices.clear(); p.edges.clear();
+		p.distance = dist[dst];
+		for(int v = dst; v != src; v = predv[v]){
+			p.vertices.push_back(v);
+			p.edges.push_back(pred[v]);
+		}
+		p.vertices.push_back(src);
+		reverse(p.vertices.begin(), p.vertices.end());
+		reverse(p.edges.begin(), p.edges.end());
+		return true;
+	}
+
+public:
+	// w must be non-negative (checked by the caller, as this may run in a worker thread).
+	YenKSP(const CSRGraph &g, const double * w): g(g), w(w),
+		dist(g.nv), pred(g.nv), predv(g.nv), seen(g.nv, 0), vban(g.nv, 0), eban(g.ne, 0), stamp(0) {}
+
+	// Returns false if the search was given up before finding K paths (see max_short).
+	bool run(int s, int t, int K, int minsize, vector<Path> &result) {
+		result.clear();
+		if(K <= 0) return true;
+		const double short_limit = (double)max_short * K;
+		double nshort = 0;
+
+		vector<Path> accepted;
+		set<Path> candidates;
+		set< vector<int> > generated;
+		Path p;
+		stamp++;
+		if(!shortest(s, t, p)) return true;
+		p.deviation = 0;
+		candidates.insert(p);
+		generated.insert(p.edges);
+
+		while(!candidates.empty() && (int)result.size() < K){
+			const Path path = *candidates.begin();
+			candidates.erase(candidates.begin());
+			accepted.push_back(path);
+			if((int)path.edges.size() >= minsize) result.push_back(path);
+			else if(++nshort > short_limit) return false;
+			if((int)result.size() >= K) break;
+
+			for(int i=path.deviation; i<(int)path.edges.size(); i++){
+				stamp++;
+				// The root path's vertices may not be revisited ...
+				for(int j=0; j<i; j++) vban[path.vertices[j]] = stamp;
+				// ... nor may the spur follow a known path sharing this root.
+				for(size_t a=0; a<accepted.size(); a++){
+					const Path &q = accepted[a];
+					if((int)q.edges.size() > i && equal(path.edges.begin(), path.edges.begin() + i, q.edges.begin()))
+						eban[q.edges[i]] = stamp;
+				}
+
+				Path spur;
+				if(shortest(path.vertices[i], t, spur)){
+					Path cand;
+					cand.vertices.assign(path.vertices.begin(), path.vertices.begin() + i);
+					cand.vertices.insert(cand.vertices.end(), spur.vertices.begin(), spur.vertices.end());
+					cand.edges.assign(path.edges.begin(), path.edges.begin() + i);
+					cand.edges.insert(cand.edges.end(), spur.edges.begin(), spur.edges.end());
+					if(!generated.insert(cand.edges).second) continue;
+					// Summed along the path, so equal paths always get equal distances.
+					cand.distance = 0.0;
+					for(size_t j=0; j<cand.edges.size(); j++) cand.distance += w[cand.edges[j]];
+					cand.deviation = i;
+					candidates.insert(cand);
+				}
+			}
+		}
+		return true;
+	}
+};
+
+/* Metropolis-Hastings sampler of the loopless paths from s to t, drawn with probabilities
+ * proportional to the product of the probabilities exp(-w) of their edges.
+ *
+ * Paths are proposed independently by random walks from s, which move along the out-edges
+ * to unvisited vertices with probabilities proportional to exp(-w). A walk proposes path p
+ * with probability prod(exp(-w_e) / Z_v) over its edges, Z_v being the sum over the edges
+ * available at the vertex it leaves, so a proposal p' is accepted with probability
+ * min(1, Z(p') / Z(p)), Z(p) being the product of the Z_v of p. Walks reaching a dead end
+ * or exceeding maxlength edges are drawn again.
+ */
+class PathSampler {
+	const CSRGraph &g;
+	const double * w;
+	vector<int> visited;
+	int stamp;
+	vector<double> cum;	// cumulative probabilities of the available out-edges
+	vector<int> avail;
+
+	static const int max_walks = 1000;	// failed walks before giving up a proposal
+
+	// Proposes a path and its log Z(p). Returns false if the walk failed.
+	bool walk(int s, int t, int maxlength, npm_rng *rng, vector<int> &edges, double &logz) {
+		stamp++;
+		edges.clear(); logz = 0.0;
+		int v = s;
+		visited[s] = stamp;
+		while(v != t){
+			if((int)edges.size() >= maxlength) return false;
+			double z = 0.0;
+			int n = 0;
+			for(int k=g.offset[v]; k<g.offset[v+1]; k++){
+				if(visited[g.head[k]] == stamp || !R_FINITE(w[g.eid[k]])) continue;
+				z += exp(-w[g.eid[k]]);
+				cum[n] = z; avail[n++] = k;
+			}
+			if(n == 0 || z <= 0.0) return false;
+			const int i = min((int)(upper_bound(cum.begin(), cum.begin() + n, npm_unif(rng) * z) - cum.begin()), n - 1);
+			logz += log(z);
+			v = g.head[avail[i]];
+			visited[v] = stamp;
+			edges.push_back(g.eid[avail[i]]);
+		}
+		return true;
+	}
+
+	bool propose(int s, int t, int maxlength, npm_rng *rng, vector<int> &edges, double &logz) {
+		for(int i=0; i<max_walks; i++)
+			if(walk(s, t, maxlength, rng, edges, logz)) return true;
+		return false;
+	}
+
+public:
+	PathSampler(const CSRGraph &g, const double * w): g(g), w(w), visited(g.nv, 0), stamp(0) {
+		int maxdeg = 0;
+		for(int v=0; v<g.nv; v++) maxdeg = max(maxdeg, g.offset[v+1] - g.offset[v]);
+		cum.resize(maxdeg); avail.resize(maxdeg);
+	}
+
+	/* Runs a chain of warmup + nsamples steps, counting the paths (by their edges) of the
+	 * last nsamples steps. Returns false if no initial path was found.
+	 */
+	bool run(int s, int t, int maxlength, int warmup, int nsamples, npm_rng *rng, map<vector<int>, int> &counts) {
+		vector<int> current, proposal;
+		double zcur, zprop;
+		if(!propose(s, t, maxlength, rng, current, zcur)) return false;
+		for(int step=0; step<warmup + nsamples; step++){
+			if(propose(s, t, maxlength, rng, proposal, zprop) && log(npm_unif(rng)) < zprop - zcur){
+				current.swap(proposal);
+				zcur = zprop;
+			}
+			if(step >= warmup) counts[current]++;
+		}
+		return true;
+	}
+};
+
+// Index of the last vertex called name, or -1.
+static int find_vertex(SEXP NAMES, const char * name)
+{
+	for(int v=LENGTH(NAMES)-1; v>=0; v--)
+		if(STRING_ELT(NAMES, v) != NA_STRING && !strcmp(CHAR(STRING_ELT(NAMES, v)), name)) return v;
+	return -1;
+}
+
+// R list of paths: 1-based vertex and edge ids, and distances.
+static SEXP paths_to_R(const vector<Path> &paths)
+{
+	SEXP OUT, NAMES, VPATHS, EPATHS, DIST;
+	PROTECT( VPATHS = NEW_LIST(paths.size()) );
+	PROTECT( EPATHS = NEW_LIST(paths.size()) );
+	PROTECT( DIST = NEW_NUMERIC(paths.size()) );
+	for(size_t i=0; i<paths.size(); i++){
+		SEXP V = NEW_INTEGER(paths[i].vertices.size());
+		SET_VECTOR_ELT(VPATHS, i, V);
+		for(size_t j=0; j<paths[i].vertices.size(); j++) INTEGER(V)[j] = paths[i].vertices[j] + 1;
+		SEXP E = NEW_INTEGER(paths[i].edges.size());
+		SET_VECTOR_ELT(EPATHS, i, E);
+		for(size_t j=0; j<paths[i].edges.size(); j++) INTEGER(E)[j] = paths[i].edges[j] + 1;
+		REAL(DIST)[i] = paths[i].distance;
+	}
+
+	PROTECT( OUT = NEW_LIST(3) );
+	PROTECT( NAMES = NEW_STRING(3) );
+	SET_VECTOR_ELT(OUT, 0, VPATHS);	SET_STRING_ELT(NAMES, 0, Rf_mkChar("vpaths"));
+	SET_VECTOR_ELT(OUT, 1, EPATHS);	SET_STRING_ELT(NAMES, 1, Rf_mkChar("epaths"));
+	SET_VECTOR_ELT(OUT, 2, DIST);	SET_STRING_ELT(NAMES, 2, Rf_mkChar("distance"));
+	Rf_setAttrib(OUT, R_NamesSymbol, NAMES);
+	UNPROTECT(5);
+	return(OUT);
+}
+
+/* Path table of the paths of all labels, without their first and last (source and sink)
+ * edges: the vertex ids (1-based) of all paths in a flat array, and the offsets (0-based)
+ * of each path in it, likewise for the edge ids, the path distances and their labels, and
+ * the number of times each path was sampled if counts are given.
+ */
+static SEXP paths_to_table(const vector< vector<Path> > &paths, const double *w, int ne,
+		const vector< vector<int> > *counts = NULL)
+{
+	size_t npaths = 0, nvids = 0, neids = 0;
+	for(size_t l=0; l<paths.size(); l++){
+		npaths += paths[l].size();
+		for(size_t i=0; i<paths[l].size(); i++){
+			nvids += paths[l][i].vertices.size() - 2;
+			neids += max(paths[l][i].edges.size(), (size_t)2) - 2;
+		}
+	}
+
+	SEXP OUT, NAMES, VOFF, EOFF, VIDS, EIDS, DIST, LABEL;
+	PROTECT( VOFF = NEW_INTEGER(npaths + 1) );
+	PROTECT( EOFF = NEW_INTEGER(npaths + 1) );
+	PROTECT( VIDS = NEW_INTEGER(nvids) );
+	PROTECT( EIDS = NEW_INTEGER(neids) );
+	PROTECT( DIST = NEW_NUMERIC(npaths) );
+	PROTECT( LABEL = NEW_INTEGER(npaths) );
+	int *voff = INTEGER(VOFF), *eoff = INTEGER(EOFF), *vids = INTEGER(VIDS), *eids = INTEGER(EIDS);
+
+	size_t p = 0;
+	voff[0] = eoff[0] = 0;
+	for(size_t l=0; l<paths.size(); l++){
+		for(size_t i=0; i<paths[l].size(); i++, p++){
+			const Path &path = paths[l][i];
+			int vi = voff[p], ei = eoff[p];
+			double dist = 0.0;
+			for(size_t j=1; j+1<path.vertices.size(); j++) vids[vi++] = path.vertices[j] + 1;
+			for(size_t j=1; j+1<path.edges.size(); j++){
+				eids[ei++] = path.edges[j] + 1;
+				dist += w[(size_t)l*ne + path.edges[j]];
+			}
+			voff[p+1] = vi; eoff[p+1] = ei;
+			REAL(DIST)[p] = dist;
+			INTEGER(LABEL)[p] = l + 1;
+		}
+	}
+
+	const int nout = counts ? 7 : 6;
+	PROTECT( OUT = NEW_LIST(nout) );
+	PROTECT( NAMES = NEW_STRING(nout) );
+	SET_VECTOR_ELT(OUT, 0, VOFF);	SET_STRING_ELT(NAMES, 0, Rf_mkChar("offsets"));
+	SET_VECTOR_ELT(OUT, 1, VIDS);	SET_STRING_ELT(NAMES, 1, Rf_mkChar("vids"));
+	SET_VECTOR_ELT(OUT, 2, EOFF);	SET_STRING_ELT(NAMES, 2, Rf_mkChar("eoffsets"));
+	SET_VECTOR_ELT(OUT, 3, EIDS);	SET_STRING_ELT(NAMES, 3, Rf_mkChar("eids"));
+	SET_VECTOR_ELT(OUT, 4, DIST);	SET_STRING_ELT(NAMES, 4, Rf_mkChar("distance"));
+	SET_VECTOR_ELT(OUT, 5, LABEL);	SET_STRING_ELT(NAMES, 5, Rf_mkChar("label"));
+	if(counts){
+		SEXP COUNT = NEW_INTEGER(npaths);
+		SET_VECTOR_ELT(OUT, 6, COUNT);	SET_STRING_ELT(NAMES, 6, Rf_mkChar("count"));
+		for(size_t l=0, p=0; l<counts->size(); l++)
+			for(size_t i=0; i<(*counts)[l].size(); i++) INTEGER(COUNT)[p++] = (*counts)[l][i];
+	}
+	Rf_setAttrib(OUT, R_NamesSymbol, NAMES);
+	UNPROTECT(8);
+	return(OUT);
+}
+
+/* The rk shortest loopless paths from vertex "s" to vertex "t" (the last vertices so named
+ * in node_list), with at least minpathsize edges.
+ *
+ * edge_list holds the 0-based tails of the edges followed by their heads. edge_weights is
+ * an (edges x labels) matrix of non-negative edge lengths, one column per label. The graph
+ * is built once, and the labels are ranked concurrently on nthreads threads. Returns, for
+ * each label, a list of the vertex and edge ids (1-based) along each path, and their
+ * distances, shortest first. If compact is set, the paths of all labels are returned as
+ * a single path table instead (see paths_to_table).
+ */
+SEXP pathranker(SEXP node_list, SEXP edge_list, SEXP edge_weights, SEXP rk, SEXP minpathsize, SEXP nthreads,
+		SEXP compact)
+{
+	const int nv = LENGTH(node_list), ne = Rf_nrows(edge_weights);
+	const int nlabels = ne > 0 ? LENGTH(edge_weights) / ne : Rf_ncols(edge_weights);
+	const int K = Rf_asInteger(rk), minsize = Rf_asInteger(minpathsize);
+	const double *w = REAL(edge_weights);
+	if(LENGTH(edge_list) != 2*ne)
+		Rf_error("Edge list and edge weights have different lengths.");
+
+	const int s = find_vertex(node_list, "s"), t = find_vertex(node_list, "t");
+	if(s < 0 || t < 0)
+		Rf_error("The graph has no source (s) or sink (t) vertex.");
+	for(size_t e=0; e<(size_t)ne*nlabels; e++){
+		if(w[e] < 0.0)
+			Rf_error("Edge weights must be non-negative.");
+	}
+
+	const CSRGraph g(nv, INTEGER(edge_list), ne);
+	vector< vector<Path> > paths(nlabels);
+	vector<char> incomplete(nlabels, 0);
+
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(npm_threads(Rf_asInteger(nthreads)))
+	for(int l=0; l<nlabels; l++){
+		YenKSP ksp(g, w + (size_t)l*ne);
+		incomplete[l] = !ksp.run(s, t, K, minsize, paths[l]);
+	}
+	if(find(incomplete.begin(), incomplete.end(), 1) != incomplete.end())
+		Rf_warning("Too many paths shorter than minPathSize for some labels. Fewer than K paths are returned for them.");
+
+	if(Rf_asLogical(compact) == TRUE)
+		return(paths_to_table(paths, w, ne));
+
+	SEXP OUT;
+	PROTECT( OUT = NEW_LIST(nlabels) );
+	for(int l=0; l<nlabels; l++){
+		SET_VECTOR_ELT(OUT, l, paths_to_R(paths[l]));
+		vector<Path>().swap(paths[l]);
+	}
+	UNPROTECT(1);
+	return(OUT);
+}
+
+// Sampled paths are reported by decreasing count, then by increasing distance.
+struct SampleOrder {
+	bool operator()(const pair<int,Path> &a, const pair<int,Path> &b) const {
+		if(a.first != b.first) return a.first > b.first;
+		return a.second < b.second;
+	}
+};
+
+/* Samples loopless paths from vertex "s" to vertex "t" (the last vertices so named in
+ * node_list) of at most MAXPATHLENGTH edges, with probabilities proportional to the product
+ * of exp(-weight) of their edges (see PathSampler).
+ *
+ * edge_list and edge_weights are as for pathranker. For each label, NCHAINS independent
+ * chains share SAMPLEPATHS samples, each after WARMUPSTEPS warm-up steps. Chains run
+ * concurrently on NTHREADS threads, each with its own random stream seeded from R's RNG, so
+ * samples are reproducible whatever the number of threads. Returns a path table (see
+ * paths_to_table) of the distinct sampled paths, with the number of times each was sampled.
+ */
+SEXP samplepaths(SEXP node_list, SEXP edge_list, SEXP edge_weights, SEXP MAXPATHLENGTH,
+		SEXP SAMPLEPATHS, SEXP WARMUPSTEPS, SEXP NCHAINS, SEXP NTHREADS)
+{
+	const int nv = LENGTH(node_list), ne = Rf_nrows(edge_weights);
+	const int nlabels = ne > 0 ? LENGTH(edge_weights) / ne : Rf_ncols(edge_weights);
+	const int maxlength = Rf_asInteger(MAXPATHLENGTH), nsamples = Rf_asInteger(SAMPLEPATHS);
+	const int warmup = max(Rf_asInteger(WARMUPSTEPS), 0), nchains = max(Rf_asInteger(NCHAINS), 1);
+	const double *w = REAL(edge_weights);
+	if(LENGTH(edge_list) != 2*ne)
+		Rf_error("Edge list and edge weights have different lengths.");
+
+	const int s = find_vertex(node_list, "s"), t = find_vertex(node_list, "t");
+	if(s < 0 || t < 0)
+		Rf_error("The graph has no source (s) or sink (t) vertex.");
+	for(size_t e=0; e<(size_t)ne*nlabels; e++){
+		if(w[e] < 0.0)
+			Rf_error("Edge weights must be non-negative.");
+	}
+
+	const CSRGraph g(nv, INTEGER(edge_list), ne);
+	const uint64_t seed = npm_seed_from_R();
+	const int nunits = nlabels * nchains;
+	vector< map<vector<int>, int> > counts(nunits);
+	vector<char> failed(nunits, 0);
+
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(npm_threads(Rf_asInteger(NTHREADS)))
+	for(int u=0; u<nunits; u++){
+		const int l = u / nchains, c = u % nchains;
+		npm_rng rng;
+		npm_rng_seed(&rng, seed, u);
+		PathSampler sampler(g, w + (size_t)l*ne);
+		const int n = nsamples / nchains + (c < nsamples % nchains);
+		failed[u] = !sampler.run(s, t, maxlength, warmup, n, &rng, counts[u]);
+	}
+	if(find(failed.begin(), failed.end(), 1) != failed.end())
+		Rf_warning("Couldn't find a path from the start to the end vertices within the maximum path length for some chains.");
+
+	// Distinct paths of each label, merged across its chains.
+	vector< vector<Path> > paths(nlabels);
+	vector< vector<int> > pcounts(nlabels);
+	const int *el = INTEGER(edge_list);
+	for(int l=0; l<nlabels; l++){
+		map<vector<int>, int> merged;
+		for(int c=0; c<nchains; c++){
+			map<vector<int>, int> &m = counts[l*nchains + c];
+			for(map<vector<int>, int>::const_iterator it=m.begin(); it!=m.end(); ++it)
+				merged[it->first] += it->second;
+			map<vector<int>, int>().swap(m);
+		}
+
+		vector< pair<int,Path> > sampled;
+		sampled.reserve(merged.size());
+		for(map<vector<int>, int>::const_iterator it=merged.begin(); it!=merged.end(); ++it){
+			Path p;
+			p.edges = it->first;
+			p.vertices.assign(1, s);
+			p.distance = 0.0;
+			for(size_t j=0; j<p.edges.size(); j++){
+				p.vertices.push_back(el[p.edges[j] + ne]);
+				p.distance += w[(size_t)l*ne + p.edges[j]];
+			}
+			p.deviation = 0;
+			sampled.push_back(make_pair(it->second, p));
+		}
+		sort(sampled.begin(), sampled.end(), SampleOrder());
+		for(size_t i=0; i<sampled.size(); i++){
+			paths[l].push_back(sampled[i].second);
+			pcounts[l].push_back(sampled[i].first);
+		}
+	}
+
+	return(paths_to_table(paths, w, ne, &pcounts));
+}
+
+// Lower bound of the Wilson score interval of a proportion of k out of n.
+static double wilson_lower(int k, int n, double z)
+{
+	if(n == 0) return 0.0;
+	const double p = (double)k / n, z2 = z*z / n;
+	return (p + z2/2 - z*sqrt(p*(1 - p)/n + z2/(4*n))) / (1 + z2);
+}
+
+/* Permutation p-values of paths.
+ *
+ * The score of a path is the sum of the lengths (edge_weights, an edges x labels matrix) of
+ * its edges for its label. Its null distribution is that of the sum of the lengths of as
+ * many edges drawn at random, without replacement, from all edges of the label, i.e. of the
+ * path score when edge weights are permuted. It is shared by all paths of a label with the
+ * same number of edges, and estimated by up to NPERM replicates. Replicates are run in
+ * blocks, concurrently on NTHREADS threads, each drawn from its own random stream. After
+ * each block, paths whose p-value is clearly above ALPHA, i.e. exceeds it whatever the
+ * remaining replicates or exceeds it with 99.9% confidence, are no longer tested.
+ *
+ * Paths are given by their 1-based edge ids EIDS, the offsets EOFFSETS of each path in EIDS
+ * and their LABEL. Returns a list of the p-values, (1 + number of replicates scoring at most
+ * as the path) / (1 + number of replicates), and the number of replicates of each path.
+ */
+SEXP scope(SEXP EDGE_WEIGHTS, SEXP EIDS, SEXP EOFFSETS, SEXP LABEL, SEXP NPERM, SEXP ALPHA, SEXP NTHREADS)
+{
+	const int ne = Rf_nrows(EDGE_WEIGHTS), npaths = LENGTH(LABEL);
+	const int nlabels = ne > 0 ? LENGTH(EDGE_WEIGHTS) / ne : Rf_ncols(EDGE_WEIGHTS);
+	const int nperm = max(Rf_asInteger(NPERM), 0), nthreads = npm_threads(Rf_asInteger(NTHREADS));
+	const int *eids = INTEGER(EIDS), *eoff = INTEGER(EOFFSETS), *label = INTEGER(LABEL);
+	const double *w = REAL(EDGE_WEIGHTS);
+
+	// Replicates scoring at most as a path, from which its p-value exceeds alpha whatever
+	// the remaining replicates.
+	const double alpha = Rf_asReal(ALPHA);
+	const int stopcount = (int)floor(alpha * (nperm + 1));
+	const int block = 256;
+
+	if(LENGTH(EOFFSETS) != npaths + 1)
+		Rf_error("Path offsets and labels have different lengths.");
+	for(int p=0; p<npaths; p++){
+		if(label[p] < 1 || label[p] > nlabels || eoff[p] < 0 || eoff[p+1] < eoff[p] || eoff[p+1] > LENGTH(EIDS)
+				|| eoff[p+1] - eoff[p] > ne)
+			Rf_error("Invalid path table.");
+		for(int j=eoff[p]; j<eoff[p+1]; j++){
+			if(eids[j] < 1 || eids[j] > ne)
+				Rf_error("Path table refers to an invalid edge.");
+		}
+	}
+
+	vector<double> observed(npaths, 0.0);
+	for(int p=0; p<npaths; p++)
+		for(int j=eoff[p]; j<eoff[p+1]; j++) observed[p] += w[(size_t)(label[p] - 1)*ne + eids[j] - 1];
+
+	// Paths sharing a null distribution: same label and number of edges.
+	vector< pair<pair<int,int>,int> > keys(npaths);
+	for(int p=0; p<npaths; p++) keys[p] = make_pair(make_pair(label[p] - 1, eoff[p+1] - eoff[p]), p);
+	sort(keys.begin(), keys.end());
+
+	vector<int> exceed(npaths, 0), nrep(npaths, 0);
+	vector<double> null(block);
+	const uint64_t seed = npm_seed_from_R();
+
+	for(int first=0; first<npaths; ){
+		int last = first;
+		while(last < npaths && keys[last].first == keys[first].first) last++;
+		const int l = keys[first].first.first, len = keys[first].first.second;
+		const double *wl = w + (size_t)l*ne;
+		const uint64_t stream = (uint64_t)l*(ne + 1) + len;
+
+		vector<int> active;
+		for(int k=first; k<last; k++) active.push_back(keys[k].second);
+		if(stopcount == 0) active.clear();
+
+		for(int r0=0; r0<nperm && !active.empty(); r0+=block){
+			const int nb = min(block, nperm - r0);
+			#pragma omp parallel num_threads(nthreads)
+			{
+				vector<int> idx(ne), drawn(len);
+				for(int e=0; e<ne; e++) idx[e] = e;
+				#pragma omp for schedule(static)
+				for(int r=0; r<nb; r++){
+					npm_rng rng;
+					npm_rng_seed(&rng, seed ^ (stream * 0x9E3779B97F4A7C15ULL), r0 + r);
+					// Partial Fisher-Yates shuffle, undone afterwards.
+					double score = 0.0;
+					for(int j=0; j<len; j++){
+						drawn[j] = j + npm_unif_index(&rng, ne - j);
+						swap(idx[j], idx[drawn[j]]);
+						score += wl[idx[j]];
+					}
+					for(int j=len-1; j>=0; j--) swap(idx[j], idx[drawn[j]]);
+					null[r] = score;
+				}
+			}
+
+			vector<int> still;
+			for(size_t a=0; a<active.size(); a++){
+				const int p = active[a];
+				for(int r=0; r<nb; r++) if(null[r] <= observed[p]) exceed[p]++;
+				nrep[p] += nb;
+				if(exceed[p] < stopcount && wilson_lower(exceed[p], nrep[p], 3.29) <= alpha) still.push_back(p);
+			}
+			active.swap(still);
+		}
+		first = last;
+	}
+
+	SEXP OUT, NAMES, PVALUE, NREP;
+	PROTECT( PVALUE = NEW_NUMERIC(npaths) );
+	PROTECT( NREP = NEW_INTEGER(npaths) );
+	for(int p=0; p<npaths; p++){
+		REAL(PVALUE)[p] = (exceed[p] + 1.0) / (nrep[p] + 1.0);
+		INTEGER(NREP)[p] = nrep[p];
+	}
+	PROTECT( OUT = NEW_LIST(2) );
+	PROTECT( NAMES = NEW_STRING(2) );
+	SET_VECTOR_ELT(OUT, 0, PVALUE);	SET_STRING_ELT(NAMES, 0, Rf_mkChar("pvalue"));
+	SET_VECTOR_ELT(OUT, 1, NREP);	SET_STRING_ELT(NAMES, 1, Rf_mkChar("replicates"));
+	Rf_setAttrib(OUT, R_NamesSymbol, NAMES);
+	UNPROTECT(4);
+	return(OUT);
+}
+
+/* Path x gene incidence matrix in compressed sparse row form.
+ *
+ * Path i visits the vertices IDS[OFFSETS[i]] .. IDS[OFFSETS[i+1]-1] (positive ids). Columns
+ * are the distinct ids, in order of their first occurrence. Returns a list of the offsets
+ * (0-based) of each row in the column indices, the sorted column indices (1-based) of each
+ * row, and the id of each column.
+ */
+SEXP binaryPaths(SEXP OFFSETS, SEXP IDS)
+{
+	const int npaths = LENGTH(OFFSETS) - 1, nids = LENGTH(IDS);
+	const int *off = INTEGER(OFFSETS), *ids = INTEGER(IDS);
+	if(npaths < 0 || off[0] != 0 || off[npaths] != nids)
+		Rf_error("Invalid path offsets.");
+
+	int maxid = 0;
+	for(int j=0; j<nids; j++){
+		if(ids[j] == NA_INTEGER || ids[j] < 1)
+			Rf_error("Invalid vertex ids.");
+		maxid = max(maxid, ids[j]);
+	}
+
+	vector<int> column(maxid + 1, -1), columns, rowptr(npaths + 1, 0), colind;
+	colind.reserve(nids);
+	for(int i=0; i<npaths; i++){
+		if(off[i+1] < off[i])
+			Rf_error("Invalid path offsets.");
+		for(int j=off[i]; j<off[i+1]; j++){
+			if(column[ids[j]] < 0){ column[ids[j]] = columns.size(); columns.push_back(ids[j]); }
+			colind.push_back(column[ids[j]] + 1);
+		}
+		sort(colind.begin() + rowptr[i], colind.end());
+		colind.erase(unique(colind.begin() + rowptr[i], colind.end()), colind.end());
+		rowptr[i+1] = colind.size();
+	}
+
+	SEXP OUT, NAMES, ROWPTR, COLIND, COLUMNS;
+	PROTECT( ROWPTR = NEW_INTEGER(npaths + 1) );
+	PROTECT( COLIND = NEW_INTEGER(colind.size()) );
+	PROTECT( COLUMNS = NEW_INTEGER(columns.size()) );
+	copy(rowptr.begin(), rowptr.end(), INTEGER(ROWPTR));
+	copy(colind.begin(), colind.end(), INTEGER(COLIND));
+	copy(columns.begin(), columns.end(), INTEGER(COLUMNS));
+
+	PROTECT( OUT = NEW_LIST(3) );
+	PROTECT( NAMES = NEW_STRING(3) );
+	SET_VECTOR_ELT(OUT, 0, ROWPTR);	SET_STRING_ELT(NAMES, 0, Rf_mkChar("rowptr"));
+	SET_VECTOR_ELT(OUT, 1, COLIND);	SET_STRING_ELT(NAMES, 1, Rf_mkChar("colind"));
+	SET_VECTOR_ELT(OUT, 2, COLUMNS);	SET_STRING_ELT(NAMES, 2, Rf_mkChar("columns"));
+	Rf_setAttrib(OUT, R_NamesSymbol, NAMES);
+	UNPROTECT(5);
+	return(OUT);
+}
+
+// Ranks a column by increasing value, for the ECDF.
+struct ColumnOrder {
+	const double *x; ColumnOrder(const double *x): x(x) {}
+	bool operator()(int a, int b) const { return x[a] < x[b]; }
+};
+
+/* Prepares a network for path ranking.
+ *
+ * A source vertex "s" (id NV) and a sink vertex "t" (id NV+1) are added to the network
+ * given by its 0-based edge list EL, with edges from s to each START vertex and from each
+ * END vertex (which is not a start) to t. START and END default (when NULL) to the
+ * vertices without in-edges and without out-edges. The added edges weigh 1 for all labels.
+ *
+ * W holds the edge weights, as an (edges x labels) matrix or a list of per-edge weights.
+ * Non-finite weights are set to the smallest finite weight of their label. Each label's
+ * weights are then scaled to probabilities by their ECDF (SCALE = "ecdf"), or rescaled
+ * linearly from [min, max] to [1, 0] (SCALE = "rescale"). If NORMALIZE is set, the
+ * probabilities of each edge are normalized across labels. ECDF probabilities are returned
+ * as -log(p), the length of the edge for the shortest path search.
+ *
+ * Returns a list of the augmented edge list (0-based) and the matrix of edge lengths.
+ */
+SEXP prepareRankNetwork(SEXP EL, SEXP NV, SEXP W, SEXP START, SEXP END, SEXP SCALE,
+		SEXP NORMALIZE, SEXP NTHREADS)
+{
+	const int nv = Rf_asInteger(NV), ne = LENGTH(EL)/2;
+	const int *el = INTEGER(EL);
+	const bool ecdf = !strcmp(CHAR(STRING_ELT(SCALE, 0)), "ecdf");
+	const int nthreads = npm_threads(Rf_asInteger(NTHREADS));
+
+	// Weights of the original edges.
+	int nlabels;
+	if(Rf_isNewList(W)){
+		if(LENGTH(W) != ne)
+			Rf_error("Edge list and edge weights have different lengths.");
+		nlabels = ne > 0 ? LENGTH(VECTOR_ELT(W, 0)) : 0;
+	}else{
+		if(Rf_nrows(W) != ne)
+			Rf_error("Edge list and edge weights have different lengths.");
+		nlabels = Rf_ncols(W);
+	}
+
+	// Source and sink vertices.
+	vector<int> indeg(nv, 0), outdeg(nv, 0);
+	for(int e=0; e<ne; e++){
+		if(el[e] < 0 || el[e] >= nv || el[e+ne] < 0 || el[e+ne] >= nv)
+			Rf_error("Edge list refers to an invalid vertex.");
+		outdeg[el[e]]++; indeg[el[e+ne]]++;
+	}
+	vector<char> is_start(nv, 0);
+	vector<int> starts, ends;
+	if(Rf_isNull(START)){
+		for(int v=0; v<nv; v++) if(indeg[v] == 0) starts.push_back(v);
+	}else{
+		starts.assign(INTEGER(START), INTEGER(START) + LENGTH(START));
+	}
+	for(size_t i=0; i<starts.size(); i++){
+		if(starts[i] < 0 || starts[i] >= nv) Rf_error("Invalid start vertex.");
+		is_start[starts[i]] = 1;
+	}
+	if(Rf_isNull(END)){
+		for(int v=0; v<nv; v++) if(outdeg[v] == 0 && !is_start[v]) ends.push_back(v);
+	}else{
+		for(int i=0; i<LENGTH(END); i++){
+			const int v = INTEGER(END)[i];
+			if(v < 0 || v >= nv) Rf_error("Invalid end vertex.");
+			if(!is_start[v]) ends.push_back(v);
+		}
+	}
+
+	// Augmented edge list.
+	const int nadded = starts.size() + ends.size(), nall = ne + nadded;
+	SEXP OUT, NAMES, AEL, PROBS;
+	PROTECT( AEL = NEW_INTEGER(2*nall) );
+	int *ael = INTEGER(AEL);
+	for(int e=0; e<ne; e++){ ael[e] = el[e]; ael[e+nall] = el[e+ne]; }
+	for(size_t i=0; i<starts.size(); i++){ ael[ne+i] = nv; ael[ne+i+nall] = starts[i]; }
+	for(size_t i=0; i<ends.size(); i++){
+		ael[ne+starts.size()+i] = ends[i];
+		ael[ne+starts.size()+i+nall] = nv + 1;
+	}
+
+	PROTECT( PROBS = Rf_allocMatrix(REALSXP, nall, nlabels) );
+	double *p = REAL(PROBS);
+	if(Rf_isNewList(W)){
+		for(int e=0; e<ne; e++){
+			SEXP we = VECTOR_ELT(W, e);
+			if(LENGTH(we) != nlabels)
+				Rf_error("Edges have different numbers of weights.");
+			if(!Rf_isReal(we)) we = Rf_coerceVector(we, REALSXP);
+			PROTECT(we);
+			for(int l=0; l<nlabels; l++) p[(size_t)l*nall + e] = REAL(we)[l];
+			UNPROTECT(1);
+		}
+	}else{
+		if(!Rf_isReal(W)) W = Rf_coerceVector(W, REALSXP);
+		PROTECT(W);
+		for(int l=0; l<nlabels; l++)
+			memcpy(p + (size_t)l*nall, REAL(W) + (size_t)l*ne, ne*sizeof(double));
+		UNPROTECT(1);
+	}
+	for(int l=0; l<nlabels; l++)
+		for(int e=ne; e<nall; e++) p[(size_t)l*nall + e] = 1.0;
+
+	// Non-finite weights are set to the minimum weight of their label.
+	bool nonfinite = false;
+	for(int l=0; l<nlabels; l++){
+		double *x = p + (size_t)l*nall, lo = R_PosInf;
+		bool any = false;
+		for(int e=0; e<nall; e++){
+			if(R_FINITE(x[e])) lo = min(lo, x[e]);
+			else any = true;
+		}
+		if(!any) continue;
+		nonfinite = true;
+		for(int e=0; e<nall; e++) if(!R_FINITE(x[e])) x[e] = lo;
+	}
+	if(nonfinite)
+		Rf_warning("Edge weights contain non-finite numbers. Setting them to the minimum edge weight");
+
+	// Scaling, one label per thread.
+	#pragma omp parallel num_threads(nthreads)
+	{
+		vector<int> order(nall);
+		#pragma omp for schedule(dynamic, 1)
+		for(int l=0; l<nlabels; l++){
+			double *x = p + (size_t)l*nall;
+			if(ecdf){
+				// ECDF(x) is the fraction of weights <= x: the rank of the last of its ties.
+				for(int e=0; e<nall; e++) order[e] = e;
+				sort(order.begin(), order.end(), ColumnOrder(x));
+				for(int a=0; a<nall; ){
+					int b = a;
+					while(b < nall && x[order[b]] == x[order[a]]) b++;
+					const double prob = (double)b / nall;
+					for(int k=a; k<b; k++) x[order[k]] = prob;
+					a = b;
+				}
+			}else{
+				double lo = R_PosInf, hi = R_NegInf;
+				for(int e=0; e<nall; e++){
+					if(ISNAN(x[e])) continue;
+					lo = min(lo, x[e]); hi = max(hi, x[e]);
+				}
+				for(int e=0; e<nall; e++) x[e] = 1.0 - (x[e] - lo)/(hi - lo);
+			}
+		}
+	}
+
+	// Normalize across labels.
+	if(nlabels > 1 && Rf_asLogical(NORMALIZE) == TRUE){
+		#pragma omp parallel for schedule(static) num_threads(nthreads)
+		for(int e=0; e<nall; e++){
+			double sum = 0.0;
+			for(int l=0; l<nlabels; l++) sum += p[(size_t)l*nall + e];
+			for(int l=0; l<nlabels; l++) p[(size_t)l*nall + e] /= sum;
+		}
+	}
+
+	if(ecdf){
+		for(size_t i=0; i<(size_t)nall*nlabels; i++) p[i] = -log(p[i]);
+	}
+
+	PROTECT( OUT = NEW_LIST(2) );
+	PROTECT( NAMES = NEW_STRING(2) );
+	SET_VECTOR_ELT(OUT, 0, AEL);	SET_STRING_ELT(NAMES, 0, Rf_mkChar("el"));
+	SET_VECTOR_ELT(OUT, 1, PROBS);	SET_STRING_ELT(NAMES, 1, Rf_mkChar("weights"));
+	Rf_setAttrib(OUT, R_NamesSymbol, NAMES);
+	UNPROTECT(4);
+	return(OUT);
+}
@@ -0,0 +1,269 @@
+#ifdef WIN_COMPILE
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include <stdint.h>
+#include <string>
+#include "init.h"
+#include "parallel.h"
+#include "exprmatrix.h"
+
+/* On-disk cache of gene connection weights.
+ *
+ * The weight of a gene connection for a label only depends on the expression of its two
+ * genes in the samples of that label, on whether it is a same-gene connection, and on the
+ * weighting options. Each (connection, label) pair is therefore keyed by a 64-bit hash of
+ * these, so entries stay valid when edges, genes or labels are added to or removed from
+ * a later call, and only the pairs with no entry need to be computed.
+ *
+ * The cache file holds a 24-byte header (the magic "NPMWCACH", the format version as a
+ * uint32, 4 bytes of padding and the number of entries as a uint64) followed by the
+ * entries, 16 bytes each: the key (uint64) and the weight (float64), sorted by key.
+ */
+#define NPM_CACHE_MAGIC "NPMWCACH"
+#define NPM_CACHE_VERSION 1
+
+static inline uint64_t hash_mix(uint64_t h, uint64_t v)
+{
+	h ^= v + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+	return h ^ (h >> 31);
+}
+
+static inline uint64_t hash_double(uint64_t h, double x)
+{
+	uint64_t bits;
+	if(std::isnan(x)) x = NA_REAL; // all missing values hash alike
+	if(x == 0.0) x = 0.0;          // so do +0 and -0
+	memcpy(&bits, &x, sizeof(bits));
+	return hash_mix(h, bits);
+}
+
+static uint64_t hash_string(const char * s)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for(; *s; s++){ h ^= (unsigned char)(*s); h *= 1099511628211ULL; }
+	return h;
+}
+
+struct CacheEntry {
+	uint64_t key;
+	double weight;
+	bool operator<(const CacheEntry &e) const { return key < e.key; }
+};
+
+// Size of an open file, or -1, with 64-bit offsets on all platforms.
+static int64_t file_size(FILE * f)
+{
+#ifdef WIN_COMPILE
+	if(_fseeki64(f, 0, SEEK_END) != 0) return -1;
+	return _ftelli64(f);
+#else
+	struct stat st;
+	if(fstat(fileno(f), &st) != 0) return -1;
+	return st.st_size;
+#endif
+}
+
+/* Reads the entries of the cache file FILENAME. A missing file is an empty cache. Returns
+ * false, with a warning, if the file is not a valid cache.
+ */
+static bool read_cache(const char * filename, vector<CacheEntry> &entries)
+{
+	entries.clear();
+	FILE * f = fopen(filename, "rb");
+	if(f == NULL) return true;
+
+	char magic[8];
+	uint32_t version, pad;
+	uint64_t n;
+	bool ok = fread(magic, 1, 8, f) == 8 && memcmp(magic, NPM_CACHE_MAGIC, 8) == 0
+		&& fread(&version, sizeof(version), 1, f) == 1 && version == NPM_CACHE_VERSION
+		&& fread(&pad, sizeof(pad), 1, f) == 1 && fread(&n, sizeof(n), 1, f) == 1;
+	// Require size == 24 + 16*n before allocating (written so that a huge n cannot overflow),
+	// so a truncated or corrupt header is ignored rather than exhausting memory.
+	if(ok){
+		const int64_t size = file_size(f);
+		ok = size >= 24 && ((uint64_t)size - 24) % 16 == 0 && n == ((uint64_t)size - 24) / 16
+			&& fseek(f, 24, SEEK_SET) == 0;
+	}
+	if(ok){
+		entries.resize(n);
+		for(uint64_t i=0; i<n && ok; i++)
+			ok = fread(&entries[i].key, sizeof(uint64_t), 1, f) == 1 && fread(&entries[i].weight, sizeof(double), 1, f) == 1;
+	}
+	fclose(f);
+	if(!ok){
+		entries.clear();
+		Rf_warning("Ignoring the invalid weight cache %s. It will not be updated.", filename);
+	}
+	return ok;
+}
+
+/* Keys of the gene connections (EL, 0-based from rows followed by to rows, and their
+ * same-gene flags SAMEG) for each sample label, as a raw vector of (connections x labels)
+ * 64-bit keys. X is an R matrix or a memory-mapped matrix, LABELS gives the label (1..NLABELS
+ * or NA) of each sample, and OPTIONS is a string describing the weighting options.
+ */
+SEXP edgeWeightKeys(SEXP X, SEXP EL, SEXP SAMEG, SEXP LABELS, SEXP NLABELS, SEXP OPTIONS, SEXP NTHREADS)
+{
+	const npm_matrix *mapped = npm_matrix_get(X);
+	if(mapped == NULL && !Rf_isReal(X))
+		X = Rf_coerceVector(X, REALSXP);
+	PROTECT(X);
+
+	const int nrow = mapped ? mapped->nrow : Rf_nrows(X), ncol = mapped ? mapped->ncol : Rf_ncols(X);
+	const int nconn = LENGTH(SAMEG), nlabels = Rf_asInteger(NLABELS);
+	const int *el = INTEGER(EL), *labels = INTEGER(LABELS);
+	const int nthreads = npm_threads(Rf_asInteger(NTHREADS));
+	const uint64_t salt = hash_string(CHAR(STRING_ELT(OPTIONS, 0)));
+
+	if(LENGTH(EL) != 2*nconn)
+		Rf_error("Edge list and same gene flags have different lengths.");
+	if(LENGTH(LABELS) != ncol)
+		Rf_error("Number of labels doesn't match samples in the microarray.");
+
+	vector<int> gene_pos(nrow, -1), genes;
+	for(int i=0; i<2*nconn; i++){
+		if(el[i] == NA_INTEGER || el[i] < 0 || el[i] >= nrow)
+			Rf_error("Edge list refers to a gene outside the microarray.");
+		if(gene_pos[el[i]] < 0){ gene_pos[el[i]] = genes.size(); genes.push_back(el[i]); }
+	}
+	for(int j=0; j<ncol; j++){
+		if(labels[j] != NA_INTEGER && (labels[j] < 1 || labels[j] > nlabels))
+			Rf_error("Invalid sample label.");
+	}
+	const int ngenes = genes.size();
+
+	// Hash of each gene's expression in the samples of each label.
+	vector<uint64_t> ghash((size_t)ngenes*nlabels);
+	#pragma omp parallel num_threads(nthreads)
+	{
+		vector<double> buf(ncol);
+		#pragma omp for schedule(static)
+		for(int g=0; g<ngenes; g++){
+			uint64_t * h = &ghash[(size_t)g*nlabels];
+			for(int l=0; l<nlabels; l++) h[l] = salt;
+			if(mapped != NULL){
+				const double *row = npm_matrix_row(mapped, genes[g], buf.empty() ? NULL : &buf[0]);
+				for(int j=0; j<ncol; j++)
+					if(labels[j] != NA_INTEGER) h[labels[j]-1] = hash_double(h[labels[j]-1], row[j]);
+			}else{
+				const double *x = REAL(X) + genes[g];
+				for(int j=0; j<ncol; j++)
+					if(labels[j] != NA_INTEGER) h[labels[j]-1] = hash_double(h[labels[j]-1], x[(size_t)j*nrow]);
+			}
+		}
+	}
+
+	SEXP KEYS;
+	PROTECT( KEYS = Rf_allocVector(RAWSXP, (R_xlen_t)nconn*nlabels*sizeof(uint64_t)) );
+	uint64_t *keys = (uint64_t *)RAW(KEYS);
+	for(int l=0; l<nlabels; l++){
+		for(int c=0; c<nconn; c++){
+			uint64_t h = hash_mix(ghash[(size_t)gene_pos[el[c]]*nlabels + l], INTEGER(SAMEG)[c] != 0);
+			keys[(size_t)l*nconn + c] = hash_mix(h, ghash[(size_t)gene_pos[el[c+nconn]]*nlabels + l]);
+		}
+	}
+
+	UNPROTECT(2);
+	return(KEYS);
+}
+
+/* Looks up KEYS in the cache file FILENAME. Returns a list of the cached (NCONN x labels)
+ * weights, whether each one was found, and whether the file is a valid cache (or missing).
+ */
+SEXP readWeightCache(SEXP FILENAME, SEXP KEYS, SEXP NCONN)
+{
+	const int nconn = Rf_asInteger(NCONN);
+	const size_t nkeys = XLENGTH(KEYS) / sizeof(uint64_t);
+	const int nlabels = nconn > 0 ? nkeys / nconn : 0;
+	const uint64_t *keys = (const uint64_t *)RAW(KEYS);
+
+	vector<CacheEntry> entries;
+	const bool valid = read_cache(R_ExpandFileName(CHAR(STRING_ELT(FILENAME, 0))), entries);
+
+	SEXP OUT, NAMES, WEIGHTS, HIT;
+	PROTECT( WEIGHTS = Rf_allocMatrix(REALSXP, nconn, nlabels) );
+	PROTECT( HIT = Rf_allocMatrix(LGLSXP, nconn, nlabels) );
+	for(size_t i=0; i<nkeys; i++){
+		CacheEntry e; e.key = keys[i];
+		vector<CacheEntry>::const_iterator it = lower_bound(entries.begin(), entries.end(), e);
+		const bool hit = it != entries.end() && it->key == keys[i];
+		REAL(WEIGHTS)[i] = hit ? it->weight : NA_REAL;
+		LOGICAL(HIT)[i] = hit;
+	}
+
+	PROTECT( OUT = NEW_LIST(3) );
+	PROTECT( NAMES = NEW_STRING(3) );
+	SET_VECTOR_ELT(OUT, 0, WEIGHTS);	SET_STRING_ELT(NAMES, 0, Rf_mkChar("weights"));
+	SET_VECTOR_ELT(OUT, 1, HIT);	SET_STRING_ELT(NAMES, 1, Rf_mkChar("hit"));
+	SET_VECTOR_ELT(OUT, 2, Rf_ScalarLogical(valid));	SET_STRING_ELT(NAMES, 2, Rf_mkChar("valid"));
+	Rf_setAttrib(OUT, R_NamesSymbol, NAMES);
+	UNPROTECT(4);
+	return(OUT);
+}
+
+/* Adds the WEIGHTS of KEYS to the cache file FILENAME, replacing existing entries. The file
+ * is rewritten through a temporary file, so an interrupted write leaves it intact. A file
+ * that is not a valid cache is never overwritten.
+ */
+SEXP writeWeightCache(SEXP FILENAME, SEXP KEYS, SEXP WEIGHTS)
+{
+	const size_t nkeys = XLENGTH(KEYS) / sizeof(uint64_t);
+	const uint64_t *keys = (const uint64_t *)RAW(KEYS);
+	if((size_t)XLENGTH(WEIGHTS) != nkeys)
+		Rf_error("Weights and keys have different lengths.");
+
+	const string filename = R_ExpandFileName(CHAR(STRING_ELT(FILENAME, 0)));
+	vector<CacheEntry> entries, merged;
+	if(!read_cache(filename.c_str(), entries))
+		Rf_error("Cannot update the invalid weight cache %s. Remove it or choose another file.", filename.c_str());
+
+	vector<CacheEntry> added(nkeys);
+	for(size_t i=0; i<nkeys; i++){ added[i].key = keys[i]; added[i].weight = REAL(WEIGHTS)[i]; }
+	stable_sort(added.begin(), added.end());
+
+	// Merge, keeping the new weight of keys present in both.
+	merged.reserve(entries.size() + added.size());
+	size_t a = 0, b = 0;
+	while(a < entries.size() || b < added.size()){
+		if(b == added.size() || (a < entries.size() && entries[a].key < added[b].key)){
+			merged.push_back(entries[a++]);
+		}else{
+			if(a < entries.size() && entries[a].key == added[b].key) a++;
+			if(merged.empty() || merged.back().key != added[b].key) merged.push_back(added[b]);
+			b++;
+		}
+	}
+
+	// The temporary file is named after the process, so concurrent writers do not share it.
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+	const string tmp = filename + suffix;
+	FILE * f = fopen(tmp.c_str(), "wb");
+	if(f == NULL)
+		Rf_error("Cannot open %s for writing.", tmp.c_str());
+	const uint32_t version = NPM_CACHE_VERSION, pad = 0;
+	const uint64_t n = merged.size();
+	bool ok = fwrite(NPM_CACHE_MAGIC, 1, 8, f) == 8 && fwrite(&version, sizeof(version), 1, f) == 1
+		&& fwrite(&pad, sizeof(pad), 1, f) == 1 && fwrite(&n, sizeof(n), 1, f) == 1;
+	for(size_t i=0; i<merged.size() && ok; i++)
+		ok = fwrite(&merged[i].key, sizeof(uint64_t), 1, f) == 1 && fwrite(&merged[i].weight, sizeof(double), 1, f) == 1;
+	if(fclose(f) != 0) ok = false;
+
+#ifdef WIN_COMPILE
+	// rename() does not replace existing files on Windows. Elsewhere it does so atomically.
+	if(ok) remove(filename.c_str());
+#endif
+	if(!ok || rename(tmp.c_str(), filename.c_str()) != 0){
+		remove(tmp.c_str());
+		Rf_error("Error writing the weight cache %s.", filename.c_str());
+	}
+	return(R_NilValue);
+}